@@ -99,14 +99,161 @@ static DTableDesc HUF_getDTableDesc(const HUF_DTable * table) {
     return dtd;
 }
 
+/*-***************************/
+/*  fast 4-streams decoding  */
+/*-***************************/
+/* The fast loop decodes the 4 streams in lockstep, with their bit containers kept in registers.
+ * A container is read from its most significant bit down, and a sentinel bit sits right below
+ * its last valid bit, so the number of bits consumed since the last refill is its count of
+ * trailing zeros and the refill is branch-free. Each iteration makes as many table lookups per
+ * stream as a refilled container can serve, so the bounds of the input and of the output are
+ * only checked once every run of iterations that can't cross them.
+ * The streams are finished by the regular loop. With BMI2, the variable shifts become
+ * shrx/shlx and the trailing zero count becomes tzcnt.
+ * Only the single-symbol decoder has one: the double-symbols loop is bound by the same chain of
+ * shift, lookup and shift, and doesn't gain from it.
+ */
+#if defined(__GNUC__) && !defined(HUF_DISABLE_FAST_DECODE) && !defined(HUF_FORCE_DECOMPRESS_X2)
+    #define HUF_ENABLE_FAST_DECODE 1
+#else
+    #define HUF_ENABLE_FAST_DECODE 0
+#endif
+
+/* A container holds at least 56 valid bits after a refill: enough for 5 lookups of up to 11 bits. */
+#define HUF_DECODER_FAST_TABLELOG 11
+
+/* With runtime dispatch, the fast loop is only used on CPUs with BMI2. */
+#if DYNAMIC_BMI2
+    #define HUF_FAST_BMI2_ATTRS TARGET_ATTRIBUTE("bmi,bmi2")
+#else
+    #define HUF_FAST_BMI2_ATTRS
+#endif
+
+#if HUF_ENABLE_FAST_DECODE
+
+typedef struct {
+    const BYTE * ip[4];     /* position of the 8 bytes loaded into bits[] */
+    BYTE * op[4];           /* next output position of every stream */
+    U64 bits[4];            /* bit containers */
+    const BYTE * istart[4]; /* first byte of every stream */
+    const BYTE * ilimit;    /* the loops never load below this */
+    BYTE * oend;
+    const void * dt;
+    U32 dtLog;
+} HUF_DecompressFastArgs;
+
+static U64 HUF_initFastDStream(const BYTE * ip) {
+    BYTE const lastByte = ip[7];
+    U32 const bitsConsumed = 8 - BIT_highbit32(lastByte); /* lastByte != 0 */
+    return (MEM_readLE64(ip) | 1) << bitsConsumed;
+}
+
+/* HUF_DecompressFastArgs_init() :
+ * @return : 1 if the fast loop can decode the block, 0 if it must be left to the regular
+ *           loop, or an error code. */
+static size_t HUF_DecompressFastArgs_init(HUF_DecompressFastArgs * args, void * dst, size_t dstSize,
+                                          const void * src, size_t srcSize, const HUF_DTable * DTable) {
+    const BYTE * const istart = (const BYTE *)src;
+    BYTE * const ostart = (BYTE *)dst;
+    U32 const dtLog = HUF_getDTableDesc(DTable).tableLog;
+    size_t const segmentSize = (dstSize + 3) / 4;
+    int stream;
+
+    /* The fast loop assumes 64-bit little-endian containers. */
+    if (!MEM_isLittleEndian() || MEM_32bits()) return 0;
+    if (srcSize < 10) return ERROR(corruption_detected); /* strict minimum : jump table + 1 byte per stream */
+    if (dtLog > HUF_DECODER_FAST_TABLELOG) return 0;
+
+    /* Read the jump table. Every stream must fill a container. */
+    {
+        size_t const length1 = MEM_readLE16(istart);
+        size_t const length2 = MEM_readLE16(istart + 2);
+        size_t const length3 = MEM_readLE16(istart + 4);
+        size_t const length4 = srcSize - (length1 + length2 + length3 + 6);
+        if (length4 > srcSize) return ERROR(corruption_detected); /* overflow */
+        if (length1 < 8 || length2 < 8 || length3 < 8 || length4 < 8) return 0;
+        args->istart[0] = istart + 6;
+        args->istart[1] = args->istart[0] + length1;
+        args->istart[2] = args->istart[1] + length2;
+        args->istart[3] = args->istart[2] + length3;
+    }
+
+    /* Tiny outputs don't reach the fast loop. */
+    if (3 * segmentSize >= dstSize) return 0;
+
+    for (stream = 0; stream < 4; stream++) {
+        const BYTE * const iend = stream == 3 ? istart + srcSize : args->istart[stream + 1];
+        args->ip[stream] = iend - sizeof(U64);
+        args->op[stream] = ostart + stream * segmentSize;
+        if (iend[-1] == 0) return ERROR(corruption_detected); /* end mark not present */
+        args->bits[stream] = HUF_initFastDStream(args->ip[stream]);
+    }
+
+    /* The loop may read below the start of a stream, into the ones before it; a stream that
+     * consumed any of those bits is caught when it is handed to the regular loop. */
+    args->ilimit = istart;
+    args->oend = ostart + dstSize;
+    args->dt = DTable + 1;
+    args->dtLog = dtLog;
+    return 1;
+}
+
+/* HUF_initRemainingDStream() :
+ * Hands a stream over to the regular loop, checking that the fast loop didn't write past the
+ * end of its segment or consume bits below its start. */
+static size_t HUF_initRemainingDStream(BIT_DStream_t * bitD, const HUF_DecompressFastArgs * args, int stream,
+                                       BYTE * segmentEnd) {
+    const BYTE * ip = args->ip[stream];
+    U32 consumed = (U32)__builtin_ctzll(args->bits[stream]);
+
+    if (args->op[stream] > segmentEnd) return ERROR(corruption_detected);
+
+    /* Move the container up to the start of the stream; the bytes it moves over were consumed. */
+    if (ip < args->istart[stream]) {
+        size_t const below = (size_t)(args->istart[stream] - ip);
+        if (below > sizeof(U64) || consumed + 8 * below > 64) return ERROR(corruption_detected);
+        consumed += (U32)(8 * below);
+        ip = args->istart[stream];
+    }
+
+    bitD->bitContainer = MEM_readLEST(ip);
+    bitD->bitsConsumed = consumed;
+    bitD->ptr = (const char *)ip;
+    bitD->start = (const char *)args->istart[stream];
+    bitD->limitPtr = bitD->start + sizeof(bitD->bitContainer);
+    return 0;
+}
+
+    #define HUF_4X_FOR_EACH_STREAM(X) \
+        X(0);                         \
+        X(1);                         \
+        X(2);                         \
+        X(3)
+
+    #define HUF_4X_FOR_EACH_STREAM_WITH_VAR(X, var) \
+        X(0, (var));                                \
+        X(1, (var));                                \
+        X(2, (var));                                \
+        X(3, (var))
+
+    /* Refill from the byte holding the next bit to read, keeping the sentinel below the last valid bit. */
+    #define HUF_4X_RELOAD_STREAM(_stream)                                   \
+        do {                                                                \
+            int const ctz = __builtin_ctzll(bits[(_stream)]);               \
+            ip[(_stream)] -= ctz >> 3;                                      \
+            bits[(_stream)] = (MEM_readLE64(ip[(_stream)]) | 1) << (ctz & 7); \
+        } while (0)
+
+#endif /* HUF_ENABLE_FAST_DECODE */
+
 #ifndef HUF_FORCE_DECOMPRESS_X2
 
 /*-***************************/
 /*  single-symbol decoding   */
 /*-***************************/
 typedef struct {
+    BYTE nbBits; /* first, so that the fast loop reads it in the low byte of an entry */
     BYTE byte;
-    BYTE nbBits;
 } HUF_DEltX1; /* single-symbol decoding */
 
 size_t HUF_readDTableX1_wksp(HUF_DTable * DTable, const void * src, size_t srcSize, void * workSpace, size_t wkspSize) {
@@ -245,6 +392,102 @@ FORCE_INLINE_TEMPLATE size_t HUF_decompress1X1_usingDTable_internal_body(void *
     return dstSize;
 }
 
+    #if HUF_ENABLE_FAST_DECODE
+
+FORCE_INLINE_TEMPLATE void HUF_decompress4X1_usingDTable_internal_fast_loop(HUF_DecompressFastArgs * args) {
+    U64 bits[4];
+    const BYTE * ip[4];
+    BYTE * op[4];
+    const U16 * const dtable = (const U16 *)args->dt; /* HUF_DEltX1 : nbBits in the low byte, byte in the high one */
+    BYTE * const oend = args->oend;
+    const BYTE * const ilimit = args->ilimit;
+    U32 const shift = 64 - args->dtLog;
+
+    memcpy(bits, args->bits, sizeof(bits));
+    memcpy((void *)ip, args->ip, sizeof(ip));
+    memcpy(op, args->op, sizeof(op));
+
+    for (;;) {
+        BYTE * olimit;
+        int stream;
+
+        /* The streams advance in lockstep and the last one has the shortest segment, so only
+         * op[3] bounds the output. An iteration reads at most 7 bytes per stream, and every
+         * stream is above the first one, so only ip[0] bounds the input. */
+        {
+            size_t const oiters = (size_t)(oend - op[3]) / 5;
+            size_t const iiters = (size_t)(ip[0] - ilimit) / 7;
+            size_t const iters = oiters < iiters ? oiters : iiters;
+            olimit = op[3] + iters * 5;
+            if (op[3] == olimit) break;
+            /* A stream below the one before it is corrupted; leave it to the regular loop. */
+            for (stream = 1; stream < 4; stream++) {
+                if (ip[stream] < ip[stream - 1]) goto out;
+            }
+        }
+
+        #define HUF_4X1_DECODE_SYMBOL(_stream, _symbol)                   \
+            do {                                                          \
+                U32 const entry = dtable[bits[(_stream)] >> shift];       \
+                bits[(_stream)] <<= entry & 0x3F;                         \
+                op[(_stream)][(_symbol)] = (BYTE)(entry >> 8);            \
+            } while (0)
+
+        #define HUF_4X1_RELOAD_STREAM(_stream) \
+            do {                               \
+                op[(_stream)] += 5;            \
+                HUF_4X_RELOAD_STREAM(_stream); \
+            } while (0)
+
+        do {
+            HUF_4X_FOR_EACH_STREAM_WITH_VAR(HUF_4X1_DECODE_SYMBOL, 0);
+            HUF_4X_FOR_EACH_STREAM_WITH_VAR(HUF_4X1_DECODE_SYMBOL, 1);
+            HUF_4X_FOR_EACH_STREAM_WITH_VAR(HUF_4X1_DECODE_SYMBOL, 2);
+            HUF_4X_FOR_EACH_STREAM_WITH_VAR(HUF_4X1_DECODE_SYMBOL, 3);
+            HUF_4X_FOR_EACH_STREAM_WITH_VAR(HUF_4X1_DECODE_SYMBOL, 4);
+            HUF_4X_FOR_EACH_STREAM(HUF_4X1_RELOAD_STREAM);
+        } while (op[3] < olimit);
+
+        #undef HUF_4X1_DECODE_SYMBOL
+        #undef HUF_4X1_RELOAD_STREAM
+    }
+
+out:
+    memcpy(args->bits, bits, sizeof(bits));
+    memcpy((void *)args->ip, ip, sizeof(ip));
+    memcpy(args->op, op, sizeof(op));
+}
+
+/* @return : the decoded size, 0 if the block must be left to the regular loop, or an error code. */
+static HUF_FAST_BMI2_ATTRS size_t HUF_decompress4X1_usingDTable_internal_fast(void * dst, size_t dstSize,
+                                                                              const void * cSrc, size_t cSrcSize,
+                                                                              const HUF_DTable * DTable) {
+    HUF_DecompressFastArgs args;
+    size_t const segmentSize = (dstSize + 3) / 4;
+    BYTE * segmentEnd = (BYTE *)dst;
+    int stream;
+
+    {
+        size_t const ret = HUF_DecompressFastArgs_init(&args, dst, dstSize, cSrc, cSrcSize, DTable);
+        if (ret == 0 || HUF_isError(ret)) return ret;
+    }
+
+    HUF_decompress4X1_usingDTable_internal_fast_loop(&args);
+
+    /* finish bitStreams one by one */
+    for (stream = 0; stream < 4; stream++) {
+        BIT_DStream_t bitD;
+        segmentEnd = stream == 3 ? args.oend : segmentEnd + segmentSize;
+        CHECK_F(HUF_initRemainingDStream(&bitD, &args, stream, segmentEnd));
+        HUF_decodeStreamX1(args.op[stream], &bitD, segmentEnd, (const HUF_DEltX1 *)args.dt, args.dtLog);
+        if (!BIT_endOfDStream(&bitD)) return ERROR(corruption_detected);
+    }
+
+    return dstSize;
+}
+
+    #endif /* HUF_ENABLE_FAST_DECODE */
+
 FORCE_INLINE_TEMPLATE size_t HUF_decompress4X1_usingDTable_internal_body(void * dst, size_t dstSize, const void * cSrc,
                                                                          size_t cSrcSize, const HUF_DTable * DTable) {
     /* Check */
@@ -343,7 +586,34 @@ typedef size_t (*HUF_decompress_usingDTable_t)(void * dst, size_t dstSize, const
                                                const HUF_DTable * DTable);
 
 HUF_DGEN(HUF_decompress1X1_usingDTable_internal)
-HUF_DGEN(HUF_decompress4X1_usingDTable_internal)
+    #if DYNAMIC_BMI2
+static TARGET_ATTRIBUTE("bmi2") size_t HUF_decompress4X1_usingDTable_internal_bmi2(void * dst, size_t dstSize,
+                                                                                   const void * cSrc, size_t cSrcSize,
+                                                                                   const HUF_DTable * DTable) {
+    return HUF_decompress4X1_usingDTable_internal_body(dst, dstSize, cSrc, cSrcSize, DTable);
+}
+    #endif
+
+static size_t HUF_decompress4X1_usingDTable_internal_default(void * dst, size_t dstSize, const void * cSrc,
+                                                              size_t cSrcSize, const HUF_DTable * DTable) {
+    return HUF_decompress4X1_usingDTable_internal_body(dst, dstSize, cSrc, cSrcSize, DTable);
+}
+
+/* Tries the fast loop first, unless it would run without BMI2 on x86. */
+static size_t HUF_decompress4X1_usingDTable_internal(void * dst, size_t dstSize, const void * cSrc, size_t cSrcSize,
+                                                      const HUF_DTable * DTable, int bmi2) {
+    #if HUF_ENABLE_FAST_DECODE
+    if (bmi2 || !DYNAMIC_BMI2) {
+        size_t const ret = HUF_decompress4X1_usingDTable_internal_fast(dst, dstSize, cSrc, cSrcSize, DTable);
+        if (ret != 0) return ret;
+    }
+    #endif
+    #if DYNAMIC_BMI2
+    if (bmi2) return HUF_decompress4X1_usingDTable_internal_bmi2(dst, dstSize, cSrc, cSrcSize, DTable);
+    #endif
+    (void)bmi2;
+    return HUF_decompress4X1_usingDTable_internal_default(dst, dstSize, cSrc, cSrcSize, DTable);
+}
 
 size_t HUF_decompress1X1_usingDTable(void * dst, size_t dstSize, const void * cSrc, size_t cSrcSize,
                                      const HUF_DTable * DTable) {
@@ -4,10 +4,70 @@
 
 #define LZ4HUF_BS (128 * 1024)
 
+/**
+ * @brief The maximum size of a single block of `n` bytes (`n` <= LZ4HUF_BS) compressed with
+ *        lz4huf_compress_blk: the worst-case LZ4 expansion plus the two block headers.
+ */
+#define LZ4HUF_BLK_COMPRESSBOUND(n) (1 + 4 + 4 + (n) + (n) / 255 + 16)
+
+/**
+ * @brief The maximum size of a single block of `n` bytes compressed with lz4huf_compress_blk_using_dict:
+ *        a regular block plus the dictionary ID.
+ */
+#define LZ4HUF_DICT_BLK_COMPRESSBOUND(n) (1 + 4 + LZ4HUF_BLK_COMPRESSBOUND(n))
+
+/**
+ * @brief The magic number every lz4huf frame starts with.
+ */
+#define LZ4HUF_MAGIC 0x4C344846
+
+/**
+ * @brief The version of the frame format written by this library.
+ */
+#define LZ4HUF_FORMAT_VERSION 1
+
+/**
+ * @brief The minimum and maximum size of a frame header.
+ */
+#define LZ4HUF_FRAME_HEADER_MIN 7
+#define LZ4HUF_FRAME_HEADER_MAX 15
+
+/**
+ * @brief Frame flag: the header records the decompressed size of the frame.
+ */
+#define LZ4HUF_FLAG_CONTENT_SIZE 0x01
+
+/**
+ * @brief Frame flag: the frame ends with an index of its blocks, which allows lz4huf_read_range
+ *        to decode any part of it without touching the blocks before it.
+ */
+#define LZ4HUF_FLAG_BLOCK_INDEX 0x02
+
+/**
+ * @brief Frame flag: the blocks are linked, i.e. LZ4 matches can reach up to 64 KB back into the blocks
+ *        before them, so the blocks of the frame have to be decoded in order.
+ */
+#define LZ4HUF_FLAG_LINKED 0x04
+
+/**
+ * @brief Frame flag: every block is followed by the CRC32C of its decompressed contents and the frame
+ *        by the CRC32C of all of its decompressed contents, which the decoders check.
+ */
+#define LZ4HUF_FLAG_CHECKSUM 0x08
+
+/**
+ * @brief The number of blocks in a chain. The blocks of a frame form chains of this many, starting
+ *        with the first one. Blocks after the first one of a chain may reuse the Huffman tables of
+ *        the blocks before them, so a chain has to be decoded in order by one context, but chains
+ *        are independent of each other.
+ */
+#define LZ4HUF_TABLE_CHAIN 8
+
 #ifndef LZ4HUF_PUBLIC_API
     #define LZ4HUF_PUBLIC_API __attribute__((visibility("default")))
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
 
 /**
@@ -30,6 +90,97 @@ struct lz4huf_buffer {
     int32_t size;
 };
 
+/**
+ * @brief The contents of a frame header.
+ */
+struct lz4huf_frame_info {
+    /**
+     * @brief The frame flags, a combination of LZ4HUF_FLAG_* values.
+     */
+    uint8_t flags;
+
+    /**
+     * @brief The decompressed size of every block in the frame but the last one.
+     */
+    uint32_t block_size;
+
+    /**
+     * @brief The decompressed size of the frame. Only valid with LZ4HUF_FLAG_CONTENT_SIZE.
+     */
+    uint64_t content_size;
+
+    /**
+     * @brief The size of the frame header; the first block starts at this offset.
+     */
+    uint32_t header_size;
+};
+
+/**
+ * @brief An opaque compression context.
+ *
+ * Owns the LZ4 and LZ4HC match finder state, the Huffman workspace and the intermediate
+ * buffers, so that compressing many blocks with one context does not allocate memory.
+ * A context must not be used by more than one thread at a time.
+ */
+struct lz4huf_cctx;
+
+/**
+ * @brief Creates a compression context.
+ *
+ * @return struct lz4huf_cctx * The context, or NULL if out of memory.
+ */
+struct lz4huf_cctx * lz4huf_cctx_create(void);
+
+/**
+ * @brief Frees a compression context. Accepts NULL.
+ *
+ * @param cctx The context.
+ */
+void lz4huf_cctx_free(struct lz4huf_cctx * cctx);
+
+/**
+ * @brief Makes the next block compressed with the context start a chain of LZ4HUF_TABLE_CHAIN blocks.
+ *
+ * Only needed before lz4huf_compress_blk_linked; lz4huf_compress_blk_into always starts a chain.
+ *
+ * @param cctx The context.
+ */
+void lz4huf_cctx_start_chain(struct lz4huf_cctx * cctx);
+
+/**
+ * @brief An opaque decompression context.
+ *
+ * Holds the Huffman decoding tables, the Huffman output scratch buffer and the final output
+ * buffer, so that decompressing many blocks with one context does not allocate memory. The
+ * tables of the last block decoded are kept for blocks that reuse them.
+ * A context must not be used by more than one thread at a time.
+ */
+struct lz4huf_dctx;
+
+/**
+ * @brief Creates a decompression context.
+ *
+ * @return struct lz4huf_dctx * The context, or NULL if out of memory.
+ */
+struct lz4huf_dctx * lz4huf_dctx_create(void);
+
+/**
+ * @brief Frees a decompression context. Accepts NULL.
+ *
+ * @param dctx The context.
+ */
+void lz4huf_dctx_free(struct lz4huf_dctx * dctx);
+
+/**
+ * @brief Makes the next block decompressed with the context start a chain of LZ4HUF_TABLE_CHAIN blocks.
+ *
+ * A block of the new chain that reuses a table is then an error until a block of the chain loads it,
+ * rather than being decoded with a table left over from another chain.
+ *
+ * @param dctx The context.
+ */
+void lz4huf_dctx_start_chain(struct lz4huf_dctx * dctx);
+
 /**
  * @brief Compresses a buffer using LZ4 and Huffman encoding.
  *
@@ -40,6 +191,74 @@ struct lz4huf_buffer {
  */
 struct lz4huf_buffer lz4huf_compress_blk(const uint8_t * src, uint32_t src_size, uint8_t level);
 
+/**
+ * @brief Compresses a buffer using LZ4 and Huffman encoding, reusing the state held by a context.
+ *
+ * @param cctx The compression context.
+ * @param src The source buffer.
+ * @param src_size The size of the source buffer. Must not exceed LZ4HUF_BS.
+ * @param level The compression level. Must be between 0 and 12.
+ * @return struct lz4huf_buffer The compressed buffer. The data is owned by the context and stays
+ *         valid until the next call using it; it must not be freed.
+ */
+struct lz4huf_buffer lz4huf_compress_blk_ctx(struct lz4huf_cctx * cctx, const uint8_t * src, uint32_t src_size,
+                                             uint8_t level);
+
+/**
+ * @brief Compresses a buffer using LZ4 and Huffman encoding straight into a caller-provided buffer.
+ *
+ * @param cctx The compression context.
+ * @param dst The destination buffer.
+ * @param dst_capacity The size of the destination buffer. LZ4HUF_BLK_COMPRESSBOUND(src_size) is always enough.
+ * @param src The source buffer.
+ * @param src_size The size of the source buffer. Must not exceed LZ4HUF_BS.
+ * @param level The compression level. Must be between 0 and 12.
+ * @return struct lz4huf_buffer The compressed buffer, pointing into `dst`. Fails if `dst` is too small.
+ */
+struct lz4huf_buffer lz4huf_compress_blk_into(struct lz4huf_cctx * cctx, uint8_t * dst, uint32_t dst_capacity,
+                                              const uint8_t * src, uint32_t src_size, uint8_t level);
+
+/**
+ * @brief Compresses the next block of a chain straight into a caller-provided buffer.
+ *
+ * Same as lz4huf_compress_blk_into, but the block may reuse the Huffman tables of the previous
+ * block compressed with the context, instead of carrying its own. Such a block can only be decoded
+ * by the context that decoded the previous one, right after it. Chains start with a block
+ * compressed by lz4huf_compress_blk_into.
+ *
+ * @param cctx The compression context.
+ * @param dst The destination buffer.
+ * @param dst_capacity The size of the destination buffer. LZ4HUF_BLK_COMPRESSBOUND(src_size) is always enough.
+ * @param src The source buffer.
+ * @param src_size The size of the source buffer. Must not exceed LZ4HUF_BS.
+ * @param level The compression level. Must be between 0 and 12.
+ * @return struct lz4huf_buffer The compressed buffer, pointing into `dst`. Fails if `dst` is too small.
+ */
+struct lz4huf_buffer lz4huf_compress_blk_chained(struct lz4huf_cctx * cctx, uint8_t * dst, uint32_t dst_capacity,
+                                                 const uint8_t * src, uint32_t src_size, uint8_t level);
+
+/**
+ * @brief Compresses the next block of a chain in a frame with LZ4HUF_FLAG_LINKED.
+ *
+ * Same as lz4huf_compress_blk_chained, but matches can reach into `history`, which holds the input
+ * of the frame before the block. Only its last 64 KB are used. Since the history is passed in rather
+ * than kept by the context, the blocks of a frame can be compressed concurrently, each with its own
+ * context. Call lz4huf_cctx_start_chain before the first block of a chain.
+ *
+ * @param cctx The compression context.
+ * @param dst The destination buffer.
+ * @param dst_capacity The size of the destination buffer. LZ4HUF_BLK_COMPRESSBOUND(src_size) is always enough.
+ * @param src The source buffer.
+ * @param src_size The size of the source buffer. Must not exceed LZ4HUF_BS.
+ * @param level The compression level. Must be between 0 and 12.
+ * @param history The input before the block. May be NULL if `history_size` is 0.
+ * @param history_size The size of `history`.
+ * @return struct lz4huf_buffer The compressed buffer, pointing into `dst`. Fails if `dst` is too small.
+ */
+struct lz4huf_buffer lz4huf_compress_blk_linked(struct lz4huf_cctx * cctx, uint8_t * dst, uint32_t dst_capacity,
+                                                const uint8_t * src, uint32_t src_size, uint8_t level,
+                                                const uint8_t * history, uint32_t history_size);
+
 /**
  * @brief Decompresses a buffer compressed with lz4huf_compress.
  *
@@ -50,7 +269,229 @@ struct lz4huf_buffer lz4huf_compress_blk(const uint8_t * src, uint32_t src_size,
 struct lz4huf_buffer lz4huf_decompress_blk(const uint8_t * src, uint32_t src_size);
 
 /**
- * @brief Compresses a buffer of arbitrary size using LZ4 and Huffman encoding.
+ * @brief Decompresses a buffer compressed with lz4huf_compress_blk, reusing the state held by a context.
+ *
+ * @param dctx The decompression context.
+ * @param src The source buffer.
+ * @param src_size The size of the source buffer.
+ * @return struct lz4huf_buffer The decompressed buffer. The data is owned by the context and stays
+ *         valid until the next call using it; it must not be freed.
+ */
+struct lz4huf_buffer lz4huf_decompress_blk_ctx(struct lz4huf_dctx * dctx, const uint8_t * src, uint32_t src_size);
+
+/**
+ * @brief Decompresses a buffer compressed with lz4huf_compress_blk straight into a caller-provided buffer.
+ *
+ * Blocks compressed with lz4huf_compress_blk_chained are decoded with the tables of the previous block
+ * decoded with the context, so the blocks of a chain must be passed to one context in order. Call
+ * lz4huf_dctx_start_chain before the first block of a chain.
+ *
+ * @param dctx The decompression context.
+ * @param dst The destination buffer.
+ * @param dst_capacity The size of the destination buffer. LZ4HUF_BS is always enough.
+ * @param src The source buffer.
+ * @param src_size The size of the source buffer.
+ * @return struct lz4huf_buffer The decompressed buffer, pointing into `dst`. Fails if `dst` is too small.
+ */
+struct lz4huf_buffer lz4huf_decompress_blk_into(struct lz4huf_dctx * dctx, uint8_t * dst, uint32_t dst_capacity,
+                                                const uint8_t * src, uint32_t src_size);
+
+/**
+ * @brief Decompresses a block of a frame with LZ4HUF_FLAG_LINKED straight into a caller-provided buffer.
+ *
+ * Same as lz4huf_decompress_blk_into, but matches can reach into `history`, which holds the data decoded
+ * from the frame before the block. Only its last 64 KB are used, and it may immediately precede `dst`.
+ *
+ * @param dctx The decompression context.
+ * @param dst The destination buffer.
+ * @param dst_capacity The size of the destination buffer. LZ4HUF_BS is always enough.
+ * @param src The source buffer.
+ * @param src_size The size of the source buffer.
+ * @param history The data decoded before the block. May be NULL if `history_size` is 0.
+ * @param history_size The size of `history`.
+ * @return struct lz4huf_buffer The decompressed buffer, pointing into `dst`. Fails if `dst` is too small.
+ */
+struct lz4huf_buffer lz4huf_decompress_blk_linked(struct lz4huf_dctx * dctx, uint8_t * dst, uint32_t dst_capacity,
+                                                  const uint8_t * src, uint32_t src_size, const uint8_t * history,
+                                                  uint32_t history_size);
+
+/**
+ * @brief An opaque dictionary, for blocks too small to compress well on their own.
+ *
+ * A dictionary holds up to 64 KB of content that LZ4 matches can reach into, as if it preceded the
+ * block, and optionally a Huffman table that blocks can use without carrying one. It is identified by
+ * a nonzero ID, which blocks compressed with it record. A dictionary is not modified once created,
+ * so it can be shared by any number of contexts and threads.
+ */
+struct lz4huf_dict;
+
+/**
+ * @brief Builds a serialised dictionary, to be loaded with lz4huf_dict_create.
+ *
+ * The Huffman table is built from what LZ4 makes of the samples with the content in front of them,
+ * in parallel. Without samples, the dictionary has no table.
+ *
+ * @param content The content. Only its last 64 KB are used, so the most useful data should come last.
+ * @param content_size The size of the content.
+ * @param samples The samples, one after the other.
+ * @param sample_sizes The size of every sample.
+ * @param num_samples The number of samples.
+ * @param id The ID of the dictionary. Must not be 0.
+ * @return struct lz4huf_buffer The serialised dictionary.
+ */
+struct lz4huf_buffer lz4huf_dict_build(const uint8_t * content, uint32_t content_size, const uint8_t * samples,
+                                       const uint32_t * sample_sizes, uint32_t num_samples, uint32_t id);
+
+/**
+ * @brief Trains a serialised dictionary on samples of the data it is meant for, to be loaded with
+ *        lz4huf_dict_create.
+ *
+ * The content is made of the segments of the samples with the most frequent substrings, and the
+ * Huffman table is built as by lz4huf_dict_build. The ID is derived from the rest of the dictionary.
+ * Uses all the threads OpenMP provides.
+ *
+ * @param samples The samples, one after the other.
+ * @param sample_sizes The size of every sample.
+ * @param num_samples The number of samples.
+ * @param dict_capacity The maximum size of the content. More than 64 KB is of no use.
+ * @return struct lz4huf_buffer The serialised dictionary.
+ */
+struct lz4huf_buffer lz4huf_train_dictionary(const uint8_t * samples, const uint32_t * sample_sizes,
+                                             uint32_t num_samples, uint32_t dict_capacity);
+
+/**
+ * @brief Loads a serialised dictionary. Indexes the content, so it is worth keeping the dictionary around.
+ *
+ * @param src The serialised dictionary.
+ * @param src_size The size of the serialised dictionary.
+ * @return struct lz4huf_dict * The dictionary, or NULL if `src` is malformed or out of memory.
+ */
+struct lz4huf_dict * lz4huf_dict_create(const uint8_t * src, uint32_t src_size);
+
+/**
+ * @brief Frees a dictionary. Accepts NULL.
+ *
+ * @param dict The dictionary.
+ */
+void lz4huf_dict_free(struct lz4huf_dict * dict);
+
+/**
+ * @brief Returns the ID of a dictionary.
+ *
+ * @param dict The dictionary.
+ * @return uint32_t The ID.
+ */
+uint32_t lz4huf_dict_id(const struct lz4huf_dict * dict);
+
+/**
+ * @brief Returns the ID of the dictionary a block was compressed with.
+ *
+ * @param src The compressed block.
+ * @param src_size The size of the compressed block.
+ * @return uint32_t The ID, or 0 if the block was compressed without a dictionary.
+ */
+uint32_t lz4huf_blk_dict_id(const uint8_t * src, uint32_t src_size);
+
+/**
+ * @brief Compresses a block with a dictionary straight into a caller-provided buffer.
+ *
+ * The block does not belong to a chain. It can only be decoded by lz4huf_decompress_blk_using_dict.
+ *
+ * @param cctx The compression context.
+ * @param dst The destination buffer.
+ * @param dst_capacity The size of the destination buffer. LZ4HUF_DICT_BLK_COMPRESSBOUND(src_size) is always
+ *        enough.
+ * @param src The source buffer.
+ * @param src_size The size of the source buffer. Must not exceed LZ4HUF_BS.
+ * @param level The compression level. Must be between 0 and 12. The table of the dictionary is only
+ *        used from level 6 up.
+ * @param dict The dictionary.
+ * @return struct lz4huf_buffer The compressed buffer, pointing into `dst`. Fails if `dst` is too small.
+ */
+struct lz4huf_buffer lz4huf_compress_blk_using_dict(struct lz4huf_cctx * cctx, uint8_t * dst,
+                                                    uint32_t dst_capacity, const uint8_t * src, uint32_t src_size,
+                                                    uint8_t level, const struct lz4huf_dict * dict);
+
+/**
+ * @brief Decompresses a block compressed with lz4huf_compress_blk_using_dict.
+ *
+ * Blocks compressed without a dictionary are decoded as by lz4huf_decompress_blk_into.
+ *
+ * @param dctx The decompression context.
+ * @param dst The destination buffer.
+ * @param dst_capacity The size of the destination buffer. LZ4HUF_BS is always enough.
+ * @param src The source buffer.
+ * @param src_size The size of the source buffer.
+ * @param dict The dictionary. Fails if the block was compressed with another one.
+ * @return struct lz4huf_buffer The decompressed buffer, pointing into `dst`. Fails if `dst` is too small.
+ */
+struct lz4huf_buffer lz4huf_decompress_blk_using_dict(struct lz4huf_dctx * dctx, uint8_t * dst,
+                                                      uint32_t dst_capacity, const uint8_t * src, uint32_t src_size,
+                                                      const struct lz4huf_dict * dict);
+
+/**
+ * @brief Returns the size of the frame header starting at `src`.
+ *
+ * Only the first LZ4HUF_FRAME_HEADER_MIN bytes of the header are needed to determine it.
+ *
+ * @param src The source buffer.
+ * @param src_size The size of the source buffer.
+ * @return uint32_t The header size, or 0 if `src` does not start with a frame this library can read.
+ */
+uint32_t lz4huf_frame_header_size(const uint8_t * src, uint32_t src_size);
+
+/**
+ * @brief Parses the frame header starting at `src`.
+ *
+ * @param info Receives the contents of the header.
+ * @param src The source buffer.
+ * @param src_size The size of the source buffer.
+ * @return uint8_t 0 if no error.
+ */
+uint8_t lz4huf_get_frame_info(struct lz4huf_frame_info * info, const uint8_t * src, uint32_t src_size);
+
+/**
+ * @brief Writes a frame header, for callers that assemble frames from lz4huf_compress_blk_into output.
+ *
+ * The blocks follow the header, each prefixed with its compressed size as a big-endian 32-bit integer,
+ * and the frame ends with a zero compressed size. Every block but the last one must hold LZ4HUF_BS bytes.
+ * Blocks compressed with lz4huf_compress_blk_chained must not start a chain of LZ4HUF_TABLE_CHAIN blocks.
+ * With LZ4HUF_FLAG_CHECKSUM, every block is followed by the lz4huf_crc32c of its input and the zero
+ * compressed size by the lz4huf_crc32c of the input of the frame, both as big-endian 32-bit integers.
+ *
+ * @param dst The destination buffer.
+ * @param dst_capacity The size of the destination buffer. LZ4HUF_FRAME_HEADER_MAX is always enough.
+ * @param flags A combination of LZ4HUF_FLAG_* values. LZ4HUF_FLAG_BLOCK_INDEX is not allowed. With
+ *        LZ4HUF_FLAG_LINKED, the blocks must be compressed with lz4huf_compress_blk_linked.
+ * @param content_size The decompressed size of the frame. Only used with LZ4HUF_FLAG_CONTENT_SIZE.
+ * @return uint32_t The header size, or 0 if `dst` is too small.
+ */
+uint32_t lz4huf_write_frame_header(uint8_t * dst, uint32_t dst_capacity, uint8_t flags, uint64_t content_size);
+
+/**
+ * @brief Computes the CRC32C (Castagnoli) of a buffer, as used by frames with LZ4HUF_FLAG_CHECKSUM.
+ *        Uses the SSE4.2 or ARMv8 CRC instructions where available.
+ *
+ * @param crc The CRC32C of the data before `src`, or 0 to start a new one.
+ * @param src The source buffer.
+ * @param src_size The size of the source buffer.
+ * @return uint32_t The CRC32C of the data before `src` followed by `src`.
+ */
+uint32_t lz4huf_crc32c(uint32_t crc, const uint8_t * src, size_t src_size);
+
+/**
+ * @brief Combines the CRC32C of two consecutive pieces of data into the CRC32C of both, without
+ *        touching the data.
+ *
+ * @param crc1 The CRC32C of the first piece.
+ * @param crc2 The CRC32C of the second piece.
+ * @param size2 The size of the second piece.
+ * @return uint32_t The CRC32C of the first piece followed by the second.
+ */
+uint32_t lz4huf_crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t size2);
+
+/**
+ * @brief Compresses a buffer of arbitrary size using LZ4 and Huffman encoding into a single frame.
  *
  * @param src The source buffer.
  * @param src_size The size of the source buffer.
@@ -60,7 +501,39 @@ struct lz4huf_buffer lz4huf_decompress_blk(const uint8_t * src, uint32_t src_siz
 struct lz4huf_buffer lz4huf_compress(const uint8_t * src, uint32_t src_size, uint8_t level);
 
 /**
- * @brief Decompresses a buffer compressed with lz4huf_compress.
+ * @brief Compresses a buffer of arbitrary size into a single frame with the given frame flags.
+ *
+ * @param src The source buffer.
+ * @param src_size The size of the source buffer.
+ * @param level The compression level. Must be between 0 and 12.
+ * @param flags A combination of LZ4HUF_FLAG_* values. LZ4HUF_FLAG_CONTENT_SIZE is always set.
+ * @return struct lz4huf_buffer The compressed buffer.
+ */
+struct lz4huf_buffer lz4huf_compress_ex(const uint8_t * src, uint32_t src_size, uint8_t level, uint8_t flags);
+
+/**
+ * @brief Returns the maximum size lz4huf_compress can produce for an input of the given size.
+ *
+ * @param src_size The size of the source buffer.
+ * @return uint64_t The worst-case compressed size.
+ */
+uint64_t lz4huf_compressBound(uint32_t src_size);
+
+/**
+ * @brief Compresses a buffer of arbitrary size into a caller-provided buffer.
+ *
+ * @param dst The destination buffer.
+ * @param dst_capacity The size of the destination buffer. lz4huf_compressBound(src_size) is always enough.
+ * @param src The source buffer.
+ * @param src_size The size of the source buffer.
+ * @param level The compression level. Must be between 0 and 12.
+ * @return struct lz4huf_buffer The compressed buffer, pointing into `dst`. Fails if `dst` is too small.
+ */
+struct lz4huf_buffer lz4huf_compress_into(uint8_t * dst, uint32_t dst_capacity, const uint8_t * src,
+                                          uint32_t src_size, uint8_t level);
+
+/**
+ * @brief Decompresses one or more concatenated frames produced by lz4huf_compress.
  *
  * @param src The source buffer.
  * @param src_size The size of the source buffer.
@@ -68,6 +541,33 @@ struct lz4huf_buffer lz4huf_compress(const uint8_t * src, uint32_t src_size, uin
  */
 struct lz4huf_buffer lz4huf_decompress(const uint8_t * src, uint32_t src_size);
 
+/**
+ * @brief Decompresses a buffer compressed with lz4huf_compress into a caller-provided buffer.
+ *
+ * @param dst The destination buffer.
+ * @param dst_capacity The size of the destination buffer.
+ * @param src The source buffer.
+ * @param src_size The size of the source buffer.
+ * @return struct lz4huf_buffer The decompressed buffer, pointing into `dst`. Fails if `dst` is too small.
+ */
+struct lz4huf_buffer lz4huf_decompress_into(uint8_t * dst, uint32_t dst_capacity, const uint8_t * src,
+                                            uint32_t src_size);
+
+/**
+ * @brief Decompresses a range of a frame written with LZ4HUF_FLAG_BLOCK_INDEX.
+ *
+ * Only the blocks overlapping the range are decoded; they are located through the index. In frames
+ * with LZ4HUF_FLAG_LINKED, the blocks before the range are decoded as well. With LZ4HUF_FLAG_CHECKSUM,
+ * the checksum of every block decoded is checked; the checksum of the frame is not.
+ *
+ * @param src The source buffer. Must hold exactly one frame.
+ * @param src_size The size of the source buffer.
+ * @param offset The offset of the range in the decompressed data.
+ * @param len The size of the range. The range must lie within the decompressed data.
+ * @return struct lz4huf_buffer The decompressed range.
+ */
+struct lz4huf_buffer lz4huf_read_range(const uint8_t * src, uint32_t src_size, uint64_t offset, uint32_t len);
+
 /**
  * @brief Compresses a buffer of arbitrary size in parallel using LZ4 and Huffman encoding.
  *
@@ -78,4 +578,228 @@ struct lz4huf_buffer lz4huf_decompress(const uint8_t * src, uint32_t src_size);
  */
 struct lz4huf_buffer lz4huf_compress_par(const uint8_t * src, uint32_t src_size, uint8_t level);
 
+/**
+ * @brief Compresses a buffer of arbitrary size in parallel with the given frame flags.
+ *
+ * @param src The source buffer.
+ * @param src_size The size of the source buffer.
+ * @param level The compression level. Must be between 0 and 12.
+ * @param flags A combination of LZ4HUF_FLAG_* values. LZ4HUF_FLAG_CONTENT_SIZE is always set. With
+ *        LZ4HUF_FLAG_LINKED, every chain starts from the input before it, so the chains are still
+ *        compressed concurrently.
+ * @return struct lz4huf_buffer The compressed buffer.
+ */
+struct lz4huf_buffer lz4huf_compress_par_ex(const uint8_t * src, uint32_t src_size, uint8_t level, uint8_t flags);
+
+/**
+ * @brief Decompresses one or more concatenated frames in parallel, decoding the blocks of every
+ *        frame concurrently straight into their place in the output. The blocks of frames with
+ *        LZ4HUF_FLAG_LINKED are decoded one after another. The checksums of frames with
+ *        LZ4HUF_FLAG_CHECKSUM are checked by the tasks that decode the blocks.
+ *
+ * @param src The source buffer.
+ * @param src_size The size of the source buffer.
+ * @return struct lz4huf_buffer The decompressed buffer.
+ */
+struct lz4huf_buffer lz4huf_decompress_par(const uint8_t * src, uint32_t src_size);
+
+/**
+ * @brief A unit of parallel work: processes the task with the given index.
+ */
+typedef void (*lz4huf_task_fn)(void * arg, uint32_t index);
+
+/**
+ * @brief Runs `task(arg, i)` for every `i` below `n_tasks`, possibly concurrently, and returns once
+ *        all of them have finished. Lets callers run parallel compression on their own threads.
+ */
+typedef void (*lz4huf_executor_fn)(void * opaque, lz4huf_task_fn task, void * arg, uint32_t n_tasks);
+
+/**
+ * @brief An opaque, persistent work-stealing thread pool.
+ *
+ * The threads sleep between jobs. A pool runs one job at a time; concurrent callers are serialised.
+ */
+struct lz4huf_pool;
+
+/**
+ * @brief Creates a thread pool.
+ *
+ * @param threads The number of threads taking part in a job, including the calling thread.
+ *                0 means one per online CPU.
+ * @return struct lz4huf_pool * The pool, or NULL if out of memory or if a thread can't be started.
+ */
+struct lz4huf_pool * lz4huf_pool_create(uint32_t threads);
+
+/**
+ * @brief Stops the threads of a pool and frees it. Accepts NULL.
+ *
+ * @param pool The pool.
+ */
+void lz4huf_pool_free(struct lz4huf_pool * pool);
+
+/**
+ * @brief The lz4huf_executor_fn of a pool; pass the pool as `opaque`.
+ *
+ * @param opaque The pool.
+ * @param task The task function.
+ * @param arg The argument passed to the task function.
+ * @param n_tasks The number of tasks. A single task runs on the calling thread.
+ */
+void lz4huf_pool_run(void * opaque, lz4huf_task_fn task, void * arg, uint32_t n_tasks);
+
+/**
+ * @brief Compresses a buffer of arbitrary size in parallel on the given executor.
+ *
+ * @param executor The executor, e.g. lz4huf_pool_run.
+ * @param opaque The first argument of the executor, e.g. a struct lz4huf_pool *.
+ * @param src The source buffer.
+ * @param src_size The size of the source buffer.
+ * @param level The compression level. Must be between 0 and 12.
+ * @param flags A combination of LZ4HUF_FLAG_* values. LZ4HUF_FLAG_CONTENT_SIZE is always set. With
+ *        LZ4HUF_FLAG_LINKED, every chain starts from the input before it, so the chains are still
+ *        compressed concurrently.
+ * @return struct lz4huf_buffer The compressed buffer.
+ */
+struct lz4huf_buffer lz4huf_compress_par_exec(lz4huf_executor_fn executor, void * opaque, const uint8_t * src,
+                                              uint32_t src_size, uint8_t level, uint8_t flags);
+
+/**
+ * @brief Decompresses one or more concatenated frames in parallel on the given executor.
+ *
+ * @param executor The executor, e.g. lz4huf_pool_run.
+ * @param opaque The first argument of the executor, e.g. a struct lz4huf_pool *.
+ * @param src The source buffer.
+ * @param src_size The size of the source buffer.
+ * @return struct lz4huf_buffer The decompressed buffer.
+ */
+struct lz4huf_buffer lz4huf_decompress_par_exec(lz4huf_executor_fn executor, void * opaque, const uint8_t * src,
+                                                uint32_t src_size);
+
+/**
+ * @brief A window of input for the streaming functions. They consume it from `pos` on.
+ */
+struct lz4huf_in_buffer {
+    /**
+     * @brief The data buffer.
+     */
+    const uint8_t * src;
+
+    /**
+     * @brief The size of the data buffer.
+     */
+    uint32_t size;
+
+    /**
+     * @brief The position up to which the data has been consumed.
+     */
+    uint32_t pos;
+};
+
+/**
+ * @brief A window of output for the streaming functions. They write to it from `pos` on.
+ */
+struct lz4huf_out_buffer {
+    /**
+     * @brief The data buffer.
+     */
+    uint8_t * dst;
+
+    /**
+     * @brief The size of the data buffer.
+     */
+    uint32_t size;
+
+    /**
+     * @brief The position up to which the buffer has been filled.
+     */
+    uint32_t pos;
+};
+
+/**
+ * @brief An opaque compression stream.
+ *
+ * Turns input of any length, pushed in pieces of any size, into a single frame without the content
+ * size, using a fixed amount of memory. Only frames with a block index grow, by 12 bytes per block.
+ */
+struct lz4huf_cstream;
+
+/**
+ * @brief Creates a compression stream.
+ *
+ * @param level The compression level. Must be between 0 and 12.
+ * @param flags A combination of LZ4HUF_FLAG_BLOCK_INDEX, LZ4HUF_FLAG_LINKED and LZ4HUF_FLAG_CHECKSUM.
+ * @return struct lz4huf_cstream * The stream, or NULL if out of memory or if the flags are not supported.
+ */
+struct lz4huf_cstream * lz4huf_cstream_create(uint8_t level, uint8_t flags);
+
+/**
+ * @brief Frees a compression stream. Accepts NULL.
+ *
+ * @param cs The stream.
+ */
+void lz4huf_cstream_free(struct lz4huf_cstream * cs);
+
+/**
+ * @brief Consumes input and produces compressed output.
+ *
+ * Returns once all of `in` has been consumed or once `out` is full. Input that doesn't fill a block
+ * is held by the stream until more input arrives or the stream is ended.
+ *
+ * @param cs The stream.
+ * @param out The output window.
+ * @param in The input window.
+ * @return uint8_t 0 if no error.
+ */
+uint8_t lz4huf_compress_stream(struct lz4huf_cstream * cs, struct lz4huf_out_buffer * out,
+                               struct lz4huf_in_buffer * in);
+
+/**
+ * @brief Compresses the input held by the stream and terminates the frame.
+ *
+ * Must be called again with more output space until it returns 0. The stream can then be used for
+ * another frame.
+ *
+ * @param cs The stream.
+ * @param out The output window.
+ * @return int32_t A lower bound on the number of bytes left to write, 0 once the frame is complete,
+ *         or -1 on error.
+ */
+int32_t lz4huf_end_stream(struct lz4huf_cstream * cs, struct lz4huf_out_buffer * out);
+
+/**
+ * @brief An opaque decompression stream.
+ *
+ * Decodes one or more concatenated frames fed in pieces of any size, such as pipe or socket reads,
+ * using a fixed amount of memory. Every block is written out as soon as it has been received whole.
+ */
+struct lz4huf_dstream;
+
+/**
+ * @brief Creates a decompression stream.
+ *
+ * @return struct lz4huf_dstream * The stream, or NULL if out of memory.
+ */
+struct lz4huf_dstream * lz4huf_dstream_create(void);
+
+/**
+ * @brief Frees a decompression stream. Accepts NULL.
+ *
+ * @param ds The stream.
+ */
+void lz4huf_dstream_free(struct lz4huf_dstream * ds);
+
+/**
+ * @brief Consumes compressed input and produces decompressed output.
+ *
+ * Returns once all of `in` has been consumed or once `out` is full.
+ *
+ * @param ds The stream.
+ * @param out The output window.
+ * @param in The input window.
+ * @return int32_t 0 if every frame seen so far has been decoded and written out completely, 1 if the
+ *         stream is inside a frame or has output left to write, or -1 if the input is corrupted.
+ */
+int32_t lz4huf_decompress_stream(struct lz4huf_dstream * ds, struct lz4huf_out_buffer * out,
+                                 struct lz4huf_in_buffer * in);
+
 #endif
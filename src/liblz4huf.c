@@ -2,358 +2,4026 @@
 #include "liblz4huf.h"
 
 #include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    #include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    #include <arm_acle.h>
+#endif
+
+#define FSE_STATIC_LINKING_ONLY
+#define HUF_STATIC_LINKING_ONLY
+#define LZ4_STATIC_LINKING_ONLY
+#define LZ4_HC_STATIC_LINKING_ONLY
+
+#include "fse.h"
+#include "hist.h"
 #include "huf.h"
 #include "lz4.h"
 #include "lz4hc.h"
 
-// Wrapper functions over compression.
+// All integers are serialised in big-endian order.
 
-static struct lz4huf_buffer lz4_compress(const uint8_t * src, uint32_t src_size, uint8_t level) {
-    uint32_t dst_capacity = LZ4_compressBound(src_size);
-    uint8_t * dst = malloc(dst_capacity + sizeof(uint32_t));
-    if (dst == NULL) {
-        struct lz4huf_buffer buf;
-        buf.error = 1;
-        buf.data = NULL;
-        buf.size = 0;
-        return buf;
+static void write_u32(uint8_t * dst, uint32_t value) {
+    dst[0] = (value >> 24) & 0xFF;
+    dst[1] = (value >> 16) & 0xFF;
+    dst[2] = (value >> 8) & 0xFF;
+    dst[3] = value & 0xFF;
+}
+
+static uint32_t read_u32(const uint8_t * src) {
+    return ((uint32_t)src[0] << 24) | ((uint32_t)src[1] << 16) | ((uint32_t)src[2] << 8) | src[3];
+}
+
+// Every entropy-coded stream has a Huffman table of its own, which the blocks of a chain can
+// carry over from one to the next: the streams of a split block, then the LZ4 payload of a
+// plain block.
+
+enum { STREAM_LITERALS, STREAM_TOKENS, STREAM_OFFSETS_LO, STREAM_OFFSETS_HI, STREAM_LENGTHS, NUM_STREAMS };
+enum { TABLE_PLAIN = NUM_STREAMS, NUM_TABLES };
+
+struct huf_table {
+    uint32_t ctable[HUF_CTABLE_SIZE_U32(HUF_SYMBOLVALUE_MAX)];
+    HUF_repeat repeat;
+};
+
+// Compression context. Owns all the state needed to compress a single block, so that it
+// can be reused across blocks without touching the allocator. The LZ4 stage always writes
+// into the scratch buffer, which stays hot in cache, and the Huffman stage writes straight
+// into the destination.
+
+#define LZ4_PAYLOAD_BOUND (sizeof(uint32_t) + LZ4_COMPRESSBOUND(LZ4HUF_BS))
+
+// How far back the blocks of a linked frame can reach: the LZ4 window.
+#define LZ4HUF_HISTORY (64 * 1024)
+
+struct lz4huf_cctx {
+    LZ4_streamHC_t hc;
+    LZ4_stream_t fast;
+    uint32_t huf_wksp[HUF_WORKSPACE_SIZE_U32];
+    FSE_CTable fse_wksp[FSE_WKSP_SIZE_U32(FSE_MAX_TABLELOG, FSE_MAX_SYMBOL_VALUE)];
+    uint8_t lz4_buf[LZ4_PAYLOAD_BOUND];
+    uint8_t huf_buf[LZ4HUF_BLK_COMPRESSBOUND(LZ4HUF_BS)];
+
+    // The LZ4 output split into separate streams, and the block built from them.
+    uint8_t seq_buf[LZ4_PAYLOAD_BOUND];
+    uint8_t split_buf[LZ4HUF_BLK_COMPRESSBOUND(LZ4HUF_BS)];
+
+    // The table of every stream as the decoder knows it after the last block, and the one the
+    // block being compressed leaves behind. Only the layout that is kept commits its tables.
+    struct huf_table tables[NUM_TABLES], next_tables[NUM_TABLES];
+
+    // The end of the input of a linked frame so far, which the match finders keep referencing
+    // whatever happens to the caller's buffers.
+    uint8_t history[LZ4HUF_HISTORY];
+};
+
+// Makes the next block carry all of its tables.
+
+static void cctx_start_chain(struct lz4huf_cctx * cctx) {
+    for (int i = 0; i < NUM_TABLES; i++) {
+        cctx->tables[i].repeat = HUF_repeat_none;
     }
+}
 
-    // Serialise the original size into the buffer.
-    dst[0] = (src_size >> 24) & 0xFF;
-    dst[1] = (src_size >> 16) & 0xFF;
-    dst[2] = (src_size >> 8) & 0xFF;
-    dst[3] = src_size & 0xFF;
+LZ4HUF_PUBLIC_API struct lz4huf_cctx * lz4huf_cctx_create(void) {
+    struct lz4huf_cctx * cctx = malloc(sizeof(struct lz4huf_cctx));
+    if (cctx == NULL) {
+        return NULL;
+    }
 
-    struct lz4huf_buffer buf;
-    buf.error = 0;
-    buf.data = dst;
+    // Both states are initialised once here, so that every block can use the cheap reset.
+    LZ4_initStreamHC(&cctx->hc, sizeof(cctx->hc));
+    LZ4_initStream(&cctx->fast, sizeof(cctx->fast));
+    cctx_start_chain(cctx);
+
+    return cctx;
+}
+
+LZ4HUF_PUBLIC_API void lz4huf_cctx_free(struct lz4huf_cctx * cctx) { free(cctx); }
+
+LZ4HUF_PUBLIC_API void lz4huf_cctx_start_chain(struct lz4huf_cctx * cctx) { cctx_start_chain(cctx); }
+
+// Makes the next linked block the first one of a frame.
+
+static void cctx_start_linked(struct lz4huf_cctx * cctx, uint8_t level) {
+    LZ4_resetStream_fast(&cctx->fast);
+    LZ4_resetStreamHC_fast(&cctx->hc, level);
+}
+
+// Makes the next linked block match into `history`, the input right before it, as if the blocks
+// that hold it had been compressed with the same context. This way linked blocks need not be
+// compressed in order.
+
+static void cctx_load_history(struct lz4huf_cctx * cctx, uint8_t level, const uint8_t * history,
+                              uint32_t history_size) {
+    if (history_size > LZ4HUF_HISTORY) {
+        history += history_size - LZ4HUF_HISTORY;
+        history_size = LZ4HUF_HISTORY;
+    }
 
+    cctx_start_linked(cctx, level);
     if (level < LZ4HC_CLEVEL_MIN) {
-        buf.size = LZ4_compress_default(src, dst + sizeof(uint32_t), src_size, dst_capacity);
+        LZ4_loadDict(&cctx->fast, (const char *)history, history_size);
     } else {
-        buf.size = LZ4_compress_HC(src, dst + sizeof(uint32_t), src_size, dst_capacity, level);
+        LZ4_loadDictHC(&cctx->hc, (const char *)history, history_size);
     }
+}
 
-    buf.size += sizeof(uint32_t);
+// Decompression context. Holds the Huffman decoding tables and the buffers the two stages
+// decode into, so that decompressing a block does not allocate. The Huffman stage decodes
+// into the scratch buffer and the LZ4 stage decodes straight into the destination; the
+// output buffer is only used by lz4huf_decompress_blk_ctx. `tables_loaded` has a bit set
+// for every table that holds the last one its stream carried. `bmi2` selects the Huffman
+// decoders built for BMI2, when the CPU has it.
+
+struct lz4huf_dctx {
+    HUF_DTable dtables[NUM_TABLES][HUF_DTABLE_SIZE(HUF_TABLELOG_MAX)];
+    uint32_t tables_loaded;
+    int bmi2;
+    FSE_DTable fse_dtable[FSE_DTABLE_SIZE_U32(FSE_MAX_TABLELOG)];
+    uint32_t huf_wksp[HUF_DECOMPRESS_WORKSPACE_SIZE_U32];
+    uint8_t huf_buf[LZ4_PAYLOAD_BOUND];
+    uint8_t lz4_buf[LZ4HUF_BS];
+};
+
+LZ4HUF_PUBLIC_API struct lz4huf_dctx * lz4huf_dctx_create(void) {
+    struct lz4huf_dctx * dctx = malloc(sizeof(struct lz4huf_dctx));
+    if (dctx == NULL) {
+        return NULL;
+    }
 
-    if (buf.size <= 0) {
-        buf.error = 1;
-        free(buf.data);
-        buf.data = NULL;
+    // Same as HUF_CREATE_STATIC_DTABLEX2: record the maximum table log the tables can hold.
+    for (int i = 0; i < NUM_TABLES; i++) {
+        dctx->dtables[i][0] = (HUF_DTable)HUF_TABLELOG_MAX * 0x01000001;
     }
 
-    return buf;
+    dctx->tables_loaded = 0;
+#if defined(__x86_64__) && defined(__GNUC__)
+    dctx->bmi2 = __builtin_cpu_supports("bmi") && __builtin_cpu_supports("bmi2");
+#else
+    dctx->bmi2 = 0;
+#endif
+
+    return dctx;
 }
 
-static struct lz4huf_buffer lz4_decompress(const uint8_t * src, uint32_t src_size) {
-    uint32_t dst_size = (src[0] << 24) | (src[1] << 16) | (src[2] << 8) | src[3];
+LZ4HUF_PUBLIC_API void lz4huf_dctx_free(struct lz4huf_dctx * dctx) { free(dctx); }
 
-    uint8_t * dst = malloc(dst_size);
-    if (dst == NULL) {
-        struct lz4huf_buffer buf;
-        buf.error = 1;
-        buf.data = NULL;
-        buf.size = 0;
-        return buf;
-    }
+// Makes a block that reuses a table an error until the table is loaded again.
+
+static void dctx_start_chain(struct lz4huf_dctx * dctx) { dctx->tables_loaded = 0; }
+
+LZ4HUF_PUBLIC_API void lz4huf_dctx_start_chain(struct lz4huf_dctx * dctx) { dctx_start_chain(dctx); }
+
+// Wrapper functions over compression.
+
+// A linked block continues the match finder state of the previous one, which then saves the
+// end of its input for the next block.
+
+static struct lz4huf_buffer lz4_compress(struct lz4huf_cctx * cctx, const uint8_t * src, uint32_t src_size,
+                                         uint8_t level, int linked) {
+    uint8_t * dst = cctx->lz4_buf;
+    uint32_t dst_capacity = LZ4_PAYLOAD_BOUND - sizeof(uint32_t);
+
+    // Serialise the original size into the buffer.
+    write_u32(dst, src_size);
 
     struct lz4huf_buffer buf;
     buf.error = 0;
     buf.data = dst;
 
-    buf.size = LZ4_decompress_safe(src + sizeof(uint32_t), dst, src_size - sizeof(uint32_t), dst_size);
+    if (linked && level < LZ4HC_CLEVEL_MIN) {
+        buf.size = LZ4_compress_fast_continue(&cctx->fast, (const char *)src, (char *)dst + sizeof(uint32_t),
+                                              src_size, dst_capacity, 1);
+        LZ4_saveDict(&cctx->fast, (char *)cctx->history, sizeof(cctx->history));
+    } else if (linked) {
+        LZ4_setCompressionLevel(&cctx->hc, level);
+        buf.size = LZ4_compress_HC_continue(&cctx->hc, (const char *)src, (char *)dst + sizeof(uint32_t), src_size,
+                                            dst_capacity);
+        LZ4_saveDictHC(&cctx->hc, (char *)cctx->history, sizeof(cctx->history));
+    } else if (level < LZ4HC_CLEVEL_MIN) {
+        buf.size = LZ4_compress_fast_extState_fastReset(&cctx->fast, (const char *)src,
+                                                        (char *)dst + sizeof(uint32_t), src_size, dst_capacity, 1);
+    } else {
+        buf.size = LZ4_compress_HC_extStateHC_fastReset(&cctx->hc, (const char *)src, (char *)dst + sizeof(uint32_t),
+                                                        src_size, dst_capacity, level);
+    }
+
     if (buf.size <= 0) {
         buf.error = 1;
-        free(buf.data);
         buf.data = NULL;
+        buf.size = 0;
+        return buf;
     }
 
+    buf.size += sizeof(uint32_t);
+
     return buf;
 }
 
-static struct lz4huf_buffer huf_compress(const uint8_t * src, uint32_t src_size, uint8_t level) {
-    uint32_t dst_capacity = HUF_compressBound(src_size);
-    uint8_t * dst = malloc(dst_capacity + 5);
-    if (dst == NULL) {
-        struct lz4huf_buffer buf;
-        buf.error = 1;
-        buf.data = NULL;
-        buf.size = 0;
+static struct lz4huf_buffer lz4_decompress(uint8_t * dst, uint32_t dst_capacity, const uint8_t * src,
+                                           uint32_t src_size, const uint8_t * history, uint32_t history_size) {
+    struct lz4huf_buffer buf;
+    buf.error = 1;
+    buf.data = NULL;
+    buf.size = 0;
+
+    if (src_size < sizeof(uint32_t)) {
+        return buf;
+    }
+
+    uint32_t dst_size = read_u32(src);
+    if (dst_size > LZ4HUF_BS || dst_size > dst_capacity) {
+        return buf;
+    }
+
+    int32_t size = LZ4_decompress_safe_usingDict((const char *)src + sizeof(uint32_t), (char *)dst,
+                                                 src_size - sizeof(uint32_t), dst_size, (const char *)history,
+                                                 history_size);
+    if (size < 0 || (uint32_t)size != dst_size) {
         return buf;
     }
 
-    struct lz4huf_buffer buf;
     buf.error = 0;
     buf.data = dst;
-    buf.size = dst_capacity;
+    buf.size = size;
 
-    if (level >= 6) {
-        buf.size = HUF_compress(dst + 5, dst_capacity, src, src_size);
-        if (buf.size <= 0) {
-            // Assume that the data simply can't be compressed...
-            memcpy(dst + 1 + sizeof(uint32_t), src, src_size);
-            buf.size = src_size;
-            dst[0] = 0;  // Uncompressed
-        } else {
-            dst[0] = 1;  // Compressed
-        }
-    } else {
-        // Store, don't compress.
-        memcpy(dst + 1 + sizeof(uint32_t), src, src_size);
-        buf.size = src_size;
-        dst[0] = 0;  // Uncompressed
+    return buf;
+}
+
+// Entropy coding. A record is a type byte, the decoded size as 4 bytes, and the data, which is
+// either stored as-is, Huffman-coded or FSE-coded. A Huffman record either starts with its
+// table or reuses the last table of the same stream. A plain block is a single record holding
+// the LZ4 payload, so the record types double as block types. A raw block has the same layout
+// as a stored record, but holds the input itself rather than an LZ4 payload, an RLE block is the
+// type byte, the size and the one byte the block repeats, a zero block is only the type byte and
+// the size, and an entropy block is the type byte and a record holding the input, entropy-coded
+// without LZ4.
+
+enum {
+    BLOCK_STORED = 0,
+    BLOCK_HUF = 1,
+    BLOCK_SPLIT = 2,
+    BLOCK_FSE = 3,
+    BLOCK_HUF_REPEAT = 4,
+    BLOCK_DICT = 5,
+    BLOCK_RAW = 6,
+    BLOCK_RLE = 7,
+    BLOCK_ENTROPY = 8,
+    BLOCK_ZERO = 9
+};
+
+// Huffman spends whole bits on every symbol, which wastes the most on skewed data, where FSE gets
+// close to the entropy. Both sizes are estimated from the histogram: Huffman's from the code
+// lengths it would use, FSE's from the entropy. FSE decodes more slowly, so it is only picked when
+// it saves more than its larger table header plus 1/32 of the Huffman size.
+
+static int prefer_fse(struct lz4huf_cctx * cctx, const uint8_t * src, uint32_t src_size) {
+    unsigned count[HUF_SYMBOLVALUE_MAX + 1];
+    unsigned max_symbol = HUF_SYMBOLVALUE_MAX;
+    size_t largest = HIST_count_wksp(count, &max_symbol, src, src_size, cctx->huf_wksp, sizeof(cctx->huf_wksp));
+    if (HIST_isError(largest) || largest <= 1 || largest == src_size) {
+        return 0;
     }
 
-    buf.size += 5;
+    HUF_CREATE_STATIC_CTABLE(ctable, HUF_SYMBOLVALUE_MAX);
+    size_t max_bits = HUF_buildCTable_wksp(ctable, count, max_symbol, HUF_TABLELOG_DEFAULT, cctx->huf_wksp,
+                                           sizeof(cctx->huf_wksp));
+    if (HUF_isError(max_bits)) {
+        return 0;
+    }
 
-    // Serialise the original size into the buffer.
-    dst[1] = (src_size >> 24) & 0xFF;
-    dst[2] = (src_size >> 16) & 0xFF;
-    dst[3] = (src_size >> 8) & 0xFF;
-    dst[4] = src_size & 0xFF;
+    double huf_size = HUF_estimateCompressedSize(ctable, count, max_symbol);
+    double fse_size = 0;
+    for (unsigned i = 0; i <= max_symbol; i++) {
+        if (count[i] > 0) {
+            fse_size += count[i] * log2((double)src_size / count[i]);
+        }
+    }
 
-    return buf;
+    fse_size /= 8;
+
+    return fse_size + 64 < huf_size - huf_size / 32;
 }
 
-static struct lz4huf_buffer huf_decompress(const uint8_t * src, uint32_t src_size) {
-    // Read the compressed flag and the original size.
-    uint8_t compressed = src[0];
-    uint32_t dst_size = (src[1] << 24) | (src[2] << 16) | (src[3] << 8) | src[4];
+static struct lz4huf_buffer entropy_compress(struct lz4huf_cctx * cctx, int table, uint8_t * dst,
+                                             uint32_t dst_capacity, const uint8_t * src, uint32_t src_size,
+                                             uint8_t level) {
+    struct lz4huf_buffer buf;
+    buf.error = 1;
+    buf.data = NULL;
+    buf.size = 0;
 
-    uint8_t * dst = malloc(dst_size);
-    if (dst == NULL) {
-        struct lz4huf_buffer buf;
-        buf.error = 1;
-        buf.data = NULL;
-        buf.size = 0;
+    if (dst_capacity < 5) {
         return buf;
     }
 
-    struct lz4huf_buffer buf;
-    buf.error = 0;
-    buf.data = dst;
-    buf.size = dst_size;
+    // Output that is not smaller than the input is useless, so don't let the coders produce it.
+    uint32_t entropy_capacity = dst_capacity - 5;
+    if (entropy_capacity > src_size) {
+        entropy_capacity = src_size;
+    }
 
-    if (compressed) {
-        buf.size = HUF_decompress(dst, dst_size, src + 5, src_size - 5);
-        if (buf.size <= 0) {
-            buf.error = 1;
-            free(buf.data);
-            buf.data = NULL;
+    // Start from the table the decoder has; Huffman replaces it when a new one pays for itself.
+    struct huf_table * next = &cctx->next_tables[table];
+    *next = cctx->tables[table];
+
+    size_t size = 0;
+    if (level >= 6 && prefer_fse(cctx, src, src_size)) {
+        size = FSE_compress_wksp(dst + 5, entropy_capacity, src, src_size, FSE_MAX_SYMBOL_VALUE, FSE_MAX_TABLELOG,
+                                 cctx->fse_wksp, sizeof(cctx->fse_wksp));
+
+        // FSE reports runs of a single symbol as 1; Huffman has a representation for those.
+        if (size > 1 && !FSE_isError(size)) {
+            dst[0] = BLOCK_FSE;
+        } else {
+            size = 0;
         }
-    } else {
-        memcpy(dst, src + 5, dst_size);
     }
 
-    return buf;
-}
+    if (level >= 6 && size == 0) {
+        HUF_repeat repeat = next->repeat;
+        size = HUF_compress4X_repeat(dst + 5, entropy_capacity, src, src_size, HUF_SYMBOLVALUE_MAX,
+                                     HUF_TABLELOG_DEFAULT, cctx->huf_wksp, sizeof(cctx->huf_wksp),
+                                     (HUF_CElt *)next->ctable, &next->repeat, 0, 0);
+        if (HUF_isError(size)) {
+            size = 0;
+        } else if (size > 1 && repeat != HUF_repeat_none && next->repeat != HUF_repeat_none) {
+            dst[0] = BLOCK_HUF_REPEAT;
+        } else if (size > 0) {
+            // A single byte is a run of one symbol, which doesn't touch the table.
+            dst[0] = BLOCK_HUF;
+            if (size > 1) {
+                next->repeat = HUF_repeat_check;
+            }
+        }
+    }
 
-// Single block compression
+    if (size == 0) {
+        // Huffman may have built a table it then didn't use.
+        *next = cctx->tables[table];
 
-LZ4HUF_PUBLIC_API struct lz4huf_buffer lz4huf_compress_blk(const uint8_t * src, uint32_t src_size, uint8_t level) {
-    assert(src_size <= LZ4HUF_BS && level <= 12 && level > 0);
+        // Either the data simply can't be compressed or we were asked not to try. Store it.
+        if (entropy_capacity < src_size) {
+            return buf;
+        }
 
-    struct lz4huf_buffer buf = lz4_compress(src, src_size, level);
-    if (buf.error) {
-        return buf;
+        memcpy(dst + 5, src, src_size);
+        size = src_size;
+        dst[0] = BLOCK_STORED;
     }
 
-    struct lz4huf_buffer buf2 = huf_compress(buf.data, buf.size, level);
-    free(buf.data);
+    // Serialise the original size into the buffer.
+    write_u32(dst + 1, src_size);
+
+    buf.error = 0;
+    buf.data = dst;
+    buf.size = size + 5;
 
-    return buf2;
+    return buf;
 }
 
-LZ4HUF_PUBLIC_API struct lz4huf_buffer lz4huf_decompress_blk(const uint8_t * src, uint32_t src_size) {
-    struct lz4huf_buffer buf = huf_decompress(src, src_size);
-    if (buf.error) {
+static struct lz4huf_buffer entropy_decompress(struct lz4huf_dctx * dctx, int table, uint8_t * dst,
+                                               uint32_t dst_capacity, const uint8_t * src, uint32_t src_size) {
+    struct lz4huf_buffer buf;
+    buf.error = 1;
+    buf.data = NULL;
+    buf.size = 0;
+
+    if (src_size < 5) {
         return buf;
     }
 
-    struct lz4huf_buffer buf2 = lz4_decompress(buf.data, buf.size);
-    free(buf.data);
-    return buf2;
-}
+    // Read the record type and the original size.
+    uint8_t type = src[0];
+    uint32_t dst_size = read_u32(src + 1);
+    if (dst_size > dst_capacity && type != BLOCK_STORED) {
+        return buf;
+    }
 
-// Multi block compression
+    src += 5;
+    src_size -= 5;
 
-LZ4HUF_PUBLIC_API struct lz4huf_buffer lz4huf_compress(const uint8_t * src, uint32_t src_size, uint8_t level) {
-    uint32_t num_blocks = (src_size + LZ4HUF_BS - 1) / LZ4HUF_BS;
-    uint32_t dst_capacity = num_blocks * LZ4HUF_BS + num_blocks * sizeof(uint32_t);
-    uint8_t * dst = malloc(dst_capacity);
-    if (dst == NULL) {
-        struct lz4huf_buffer buf;
-        buf.error = 1;
-        buf.data = NULL;
-        buf.size = 0;
+    size_t size;
+    switch (type) {
+        case BLOCK_STORED:
+            if (src_size != dst_size) {
+                return buf;
+            }
+
+            // Stored data can be handed to the next stage as-is.
+            buf.error = 0;
+            buf.data = (uint8_t *)src;
+            buf.size = dst_size;
+            return buf;
+        case BLOCK_HUF:
+            if (src_size == 1) {
+                // HUF_compress emits a single byte for blocks made of one repeated symbol.
+                memset(dst, src[0], dst_size);
+                size = dst_size;
+            } else {
+                dctx->tables_loaded &= ~(1u << table);
+                size = HUF_decompress4X_hufOnly_wksp_bmi2(dctx->dtables[table], dst, dst_size, src, src_size,
+                                                          dctx->huf_wksp, sizeof(dctx->huf_wksp), dctx->bmi2);
+                if (!HUF_isError(size)) {
+                    dctx->tables_loaded |= 1u << table;
+                }
+            }
+            break;
+        case BLOCK_HUF_REPEAT:
+            if (!(dctx->tables_loaded & (1u << table))) {
+                return buf;
+            }
+
+            size = HUF_decompress4X_usingDTable_bmi2(dst, dst_size, src, src_size, dctx->dtables[table], dctx->bmi2);
+            break;
+        case BLOCK_FSE:
+            size = FSE_decompress_wksp(dst, dst_size, src, src_size, dctx->fse_dtable, FSE_MAX_TABLELOG);
+            break;
+        default:
+            return buf;
+    }
+
+    if (HUF_isError(size) || size != dst_size) {
         return buf;
     }
 
-    struct lz4huf_buffer buf;
     buf.error = 0;
     buf.data = dst;
-    buf.size = dst_capacity;
+    buf.size = dst_size;
 
-    uint32_t out_ptr = 0;
-    for (uint32_t i = 0; i < num_blocks; i++) {
-        uint32_t block_size = LZ4HUF_BS;
-        if (i == num_blocks - 1) {
-            block_size = src_size - (num_blocks - 1) * LZ4HUF_BS;
-        }
+    return buf;
+}
 
-        struct lz4huf_buffer buf2 = lz4huf_compress_blk(src + i * LZ4HUF_BS, block_size, level);
-        if (buf2.error) {
-            buf.error = 1;
-            free(buf.data);
-            buf.data = NULL;
-            return buf;
+// Separate streams. The LZ4 output mixes literals, tokens, offsets and length bytes, whose
+// statistics have little in common, so a single Huffman table fits none of them well. A split
+// block takes the LZ4 sequences apart into one stream per kind of field, each entropy-coded on
+// its own, and the decoder executes the sequences straight from the streams.
+//
+// A split block is the block type byte, the decompressed size as 4 bytes, and the streams in
+// the order of the STREAM_* constants. Every stream is its size as 4 bytes followed by an
+// entropy-coded record.
+
+// Sizes of the streams of an LZ4 payload, in a first pass, and the streams themselves, in a
+// second pass, once the sizes have given the position of each stream in `dst`. Returns 1 if
+// the payload is malformed.
+
+static int split_sequences(const uint8_t * src, uint32_t src_size, uint8_t ** streams, uint32_t * sizes) {
+    const uint8_t * ip = src, * iend = src + src_size;
+    uint32_t n[NUM_STREAMS] = { 0 };
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        if (streams) streams[STREAM_TOKENS][n[STREAM_TOKENS]] = token;
+        n[STREAM_TOKENS]++;
+
+        uint32_t literals = token >> 4;
+        if (literals == 15) {
+            uint8_t b;
+            do {
+                if (ip == iend) return 1;
+                b = *ip++;
+                if (streams) streams[STREAM_LENGTHS][n[STREAM_LENGTHS]] = b;
+                n[STREAM_LENGTHS]++;
+                literals += b;
+            } while (b == 255);
         }
 
-        // Serialise the compressed len.
-        dst[out_ptr++] = (buf2.size >> 24) & 0xFF;
-        dst[out_ptr++] = (buf2.size >> 16) & 0xFF;
-        dst[out_ptr++] = (buf2.size >> 8) & 0xFF;
-        dst[out_ptr++] = buf2.size & 0xFF;
+        if (literals > (uint32_t)(iend - ip)) return 1;
+        if (streams) memcpy(streams[STREAM_LITERALS] + n[STREAM_LITERALS], ip, literals);
+        n[STREAM_LITERALS] += literals;
+        ip += literals;
 
-        memcpy(dst + out_ptr, buf2.data, buf2.size);
-        free(buf2.data);
-        out_ptr += buf2.size;
-    }
+        // The last sequence has no match.
+        if (ip == iend) break;
 
-    buf.size = out_ptr;
+        if (iend - ip < 2) return 1;
+        if (streams) {
+            streams[STREAM_OFFSETS_LO][n[STREAM_OFFSETS_LO]] = ip[0];
+            streams[STREAM_OFFSETS_HI][n[STREAM_OFFSETS_HI]] = ip[1];
+        }
+        n[STREAM_OFFSETS_LO]++;
+        n[STREAM_OFFSETS_HI]++;
+        ip += 2;
+
+        if ((token & 15) == 15) {
+            uint8_t b;
+            do {
+                if (ip == iend) return 1;
+                b = *ip++;
+                if (streams) streams[STREAM_LENGTHS][n[STREAM_LENGTHS]] = b;
+                n[STREAM_LENGTHS]++;
+            } while (b == 255);
+        }
+    }
 
-    return buf;
+    memcpy(sizes, n, sizeof(n));
+    return 0;
 }
 
-LZ4HUF_PUBLIC_API struct lz4huf_buffer lz4huf_decompress(const uint8_t * src, uint32_t src_size) {
-    // Count the number of blocks.
-    uint32_t num_blocks = 0, i;
-    uint64_t in_ptr = 0;
-    while (in_ptr < src_size) {
-        uint32_t compressed_len = (src[in_ptr++] << 24) | (src[in_ptr++] << 16) | (src[in_ptr++] << 8) | src[in_ptr++];
-        in_ptr += compressed_len;
-        num_blocks++;
+static struct lz4huf_buffer split_compress(struct lz4huf_cctx * cctx, uint8_t * dst, uint32_t dst_capacity,
+                                           const uint8_t * src, uint32_t src_size, uint32_t orig_size,
+                                           uint8_t level) {
+    struct lz4huf_buffer buf;
+    buf.error = 1;
+    buf.data = NULL;
+    buf.size = 0;
+
+    uint32_t sizes[NUM_STREAMS];
+    if (split_sequences(src, src_size, NULL, sizes)) {
+        return buf;
     }
 
-    uint32_t dst_capacity = num_blocks * LZ4HUF_BS + 256;
-    uint8_t * dst = malloc(dst_capacity);
-    if (dst == NULL) {
-        struct lz4huf_buffer buf;
-        buf.error = 1;
-        buf.data = NULL;
-        buf.size = 0;
+    uint8_t * streams[NUM_STREAMS];
+    uint8_t * stream_ptr = cctx->seq_buf;
+    for (int i = 0; i < NUM_STREAMS; i++) {
+        streams[i] = stream_ptr;
+        stream_ptr += sizes[i];
+    }
+
+    split_sequences(src, src_size, streams, sizes);
+
+    if (dst_capacity < 5) {
         return buf;
     }
 
-    struct lz4huf_buffer buf;
-    buf.error = 0;
-    buf.data = dst;
-    buf.size = dst_capacity;
+    dst[0] = BLOCK_SPLIT;
+    write_u32(dst + 1, orig_size);
+    uint32_t out_ptr = 5;
 
-    in_ptr = 0;
-    uint32_t out_ptr = 0;
-    for (uint32_t i = 0; i < num_blocks; i++) {
-        uint32_t compressed_len = (src[in_ptr++] << 24) | (src[in_ptr++] << 16) | (src[in_ptr++] << 8) | src[in_ptr++];
+    for (int i = 0; i < NUM_STREAMS; i++) {
+        if (dst_capacity - out_ptr < sizeof(uint32_t)) {
+            return buf;
+        }
 
-        struct lz4huf_buffer buf2 = lz4huf_decompress_blk(src + in_ptr, compressed_len);
-        if (buf2.error || buf2.size > LZ4HUF_BS) {
-            buf.error = 1;
-            free(buf.data);
-            buf.data = NULL;
+        uint8_t * stream_dst = dst + out_ptr + sizeof(uint32_t);
+        uint32_t stream_capacity = dst_capacity - out_ptr - sizeof(uint32_t);
+        struct lz4huf_buffer buf2 =
+            entropy_compress(cctx, i, stream_dst, stream_capacity, streams[i], sizes[i], level);
+        if (buf2.error) {
             return buf;
         }
 
-        memcpy(dst + out_ptr, buf2.data, buf2.size);
-        free(buf2.data);
-        in_ptr += compressed_len;
-        out_ptr += buf2.size;
+        write_u32(dst + out_ptr, buf2.size);
+        out_ptr += sizeof(uint32_t) + buf2.size;
     }
 
+    buf.error = 0;
+    buf.data = dst;
     buf.size = out_ptr;
 
     return buf;
 }
 
-// Parallel multi block compression using OpenMP.
+// Copies a match that may overlap its own output. When the output has room for the overshoot,
+// whole 16 or 8 byte words are moved; a match closer than that is first spread out byte by
+// byte until the distance to its source allows word copies.
 
-LZ4HUF_PUBLIC_API struct lz4huf_buffer lz4huf_compress_par(const uint8_t * src, uint32_t src_size, uint8_t level) {
-    int num_blocks = (src_size + LZ4HUF_BS - 1) / LZ4HUF_BS;
-    struct lz4huf_buffer * bufs = malloc(num_blocks * sizeof(struct lz4huf_buffer));
-    if (bufs == NULL) {
-        struct lz4huf_buffer buf;
-        buf.error = 1;
-        buf.data = NULL;
-        buf.size = 0;
-        return buf;
+#define WILDCOPY_SLACK 16
+
+static inline void copy_match(uint8_t * op, const uint8_t * match, uint32_t length, const uint8_t * oend) {
+    uint8_t * end = op + length;
+    if ((size_t)(oend - end) < WILDCOPY_SLACK) {
+        while (op < end) *op++ = *match++;
+        return;
     }
 
-#pragma omp parallel for
-    for (int i = 0; i < num_blocks; i++) {
-        uint32_t block_size = LZ4HUF_BS;
-        if (i == num_blocks - 1) {
-            block_size = src_size - (num_blocks - 1) * LZ4HUF_BS;
-        }
+    size_t offset = op - match;
+    if (offset >= 16) {
+        do {
+            memcpy(op, match, 16);
+            op += 16;
+            match += 16;
+        } while (op < end);
+        return;
+    }
 
-        bufs[i] = lz4huf_compress_blk(src + i * LZ4HUF_BS, block_size, level);
+    if (offset < 8) {
+        // The pattern repeats every `offset` bytes, so copying from a multiple of it at least 8
+        // bytes back yields the same output.
+        size_t distance = offset * ((8 + offset - 1) / offset);
+        for (size_t i = 0; i < distance && op < end; i++) *op++ = *match++;
+        match = op - distance;
     }
 
-    uint32_t dst_capacity = 0;
-    for (int i = 0; i < num_blocks; i++) {
-        if (bufs[i].error) {
-            for (int j = 0; j < num_blocks; j++) {
-                free(bufs[j].data);
-            }
-            free(bufs);
-            struct lz4huf_buffer buf;
-            buf.error = 1;
-            buf.data = NULL;
-            buf.size = 0;
-            return buf;
-        }
+    while (op < end) {
+        memcpy(op, match, 8);
+        op += 8;
+        match += 8;
+    }
+}
+
+static struct lz4huf_buffer split_decompress(struct lz4huf_dctx * dctx, uint8_t * dst, uint32_t dst_capacity,
+                                             const uint8_t * src, uint32_t src_size, const uint8_t * history,
+                                             uint32_t history_size) {
+    struct lz4huf_buffer buf;
+    buf.error = 1;
+    buf.data = NULL;
+    buf.size = 0;
 
-        dst_capacity += bufs[i].size + sizeof(uint32_t);
+    if (src_size < 5) {
+        return buf;
     }
 
-    uint8_t * dst = malloc(dst_capacity);
-    if (dst == NULL) {
-        for (int j = 0; j < num_blocks; j++) {
-            free(bufs[j].data);
-        }
-        free(bufs);
-        struct lz4huf_buffer buf;
-        buf.error = 1;
-        buf.data = NULL;
-        buf.size = 0;
+    uint32_t dst_size = read_u32(src + 1);
+    if (dst_size > LZ4HUF_BS || dst_size > dst_capacity) {
         return buf;
     }
 
-    struct lz4huf_buffer buf;
-    buf.error = 0;
-    buf.data = dst;
-    buf.size = dst_capacity;
+    // Decode the streams one after another into the scratch buffer.
+    const uint8_t * streams[NUM_STREAMS], * ends[NUM_STREAMS];
+    uint32_t in_ptr = 5, scratch_ptr = 0;
+    for (int i = 0; i < NUM_STREAMS; i++) {
+        if (src_size - in_ptr < sizeof(uint32_t)) {
+            return buf;
+        }
 
-    uint32_t out_ptr = 0;
+        uint32_t len = read_u32(src + in_ptr);
+        in_ptr += sizeof(uint32_t);
+        if (len > src_size - in_ptr) {
+            return buf;
+        }
 
-    for (int i = 0; i < num_blocks; i++) {
-        // Serialise the compressed len.
-        dst[out_ptr++] = (bufs[i].size >> 24) & 0xFF;
-        dst[out_ptr++] = (bufs[i].size >> 16) & 0xFF;
-        dst[out_ptr++] = (bufs[i].size >> 8) & 0xFF;
-        dst[out_ptr++] = bufs[i].size & 0xFF;
+        struct lz4huf_buffer buf2 = entropy_decompress(dctx, i, dctx->huf_buf + scratch_ptr,
+                                                       sizeof(dctx->huf_buf) - scratch_ptr, src + in_ptr, len);
+        if (buf2.error) {
+            return buf;
+        }
+
+        if (buf2.data == dctx->huf_buf + scratch_ptr) {
+            scratch_ptr += buf2.size;
+        }
 
-        memcpy(dst + out_ptr, bufs[i].data, bufs[i].size);
-        free(bufs[i].data);
-        out_ptr += bufs[i].size;
+        streams[i] = buf2.data;
+        ends[i] = buf2.data + buf2.size;
+        in_ptr += len;
     }
 
-    free(bufs);
+    if (in_ptr != src_size) {
+        return buf;
+    }
 
-    buf.size = out_ptr;
+    // Execute the sequences.
+    const uint8_t * lit = streams[STREAM_LITERALS], * tok = streams[STREAM_TOKENS];
+    const uint8_t * off_lo = streams[STREAM_OFFSETS_LO], * off_hi = streams[STREAM_OFFSETS_HI];
+    const uint8_t * len = streams[STREAM_LENGTHS];
+    uint8_t * op = dst, * oend = dst + dst_size;
+    while (tok < ends[STREAM_TOKENS]) {
+        uint8_t token = *tok++;
+
+        uint32_t literals = token >> 4;
+        if (literals == 15) {
+            uint8_t b;
+            do {
+                if (len == ends[STREAM_LENGTHS]) return buf;
+                b = *len++;
+                literals += b;
+            } while (b == 255);
+        }
+
+        if (literals > (size_t)(ends[STREAM_LITERALS] - lit) || literals > (size_t)(oend - op)) {
+            return buf;
+        }
+
+        // Literals are moved in whole words when both sides have room for the overshoot.
+        if ((size_t)(ends[STREAM_LITERALS] - lit) >= literals + WILDCOPY_SLACK &&
+            (size_t)(oend - op) >= literals + WILDCOPY_SLACK) {
+            memcpy(op, lit, 16);
+            if (literals > 16) {
+                uint8_t * to = op + 16, * end = op + literals;
+                const uint8_t * from = lit + 16;
+                for (; to < end; to += 16, from += 16) memcpy(to, from, 16);
+            }
+        } else {
+            memcpy(op, lit, literals);
+        }
+
+        op += literals;
+        lit += literals;
+
+        // The last sequence has no match.
+        if (tok == ends[STREAM_TOKENS]) break;
+
+        if (off_lo == ends[STREAM_OFFSETS_LO] || off_hi == ends[STREAM_OFFSETS_HI]) {
+            return buf;
+        }
+
+        uint32_t offset = *off_lo++ | (uint32_t)*off_hi++ << 8;
+        uint32_t match_len = (token & 15) + 4;
+        if ((token & 15) == 15) {
+            uint8_t b;
+            do {
+                if (len == ends[STREAM_LENGTHS]) return buf;
+                b = *len++;
+                match_len += b;
+            } while (b == 255);
+        }
+
+        if (offset == 0 || match_len > (size_t)(oend - op)) {
+            return buf;
+        }
+
+        if (offset <= (size_t)(op - dst)) {
+            copy_match(op, op - offset, match_len, oend);
+        } else {
+            // The match starts in the history and may run on into the block.
+            size_t back = offset - (op - dst);
+            if (back > history_size) {
+                return buf;
+            }
+
+            size_t n = back < match_len ? back : match_len;
+            memcpy(op, history + history_size - back, n);
+            if (match_len > n) {
+                copy_match(op + n, dst, match_len - n, oend);
+            }
+        }
+
+        op += match_len;
+    }
+
+    // Everything must have been used up.
+    if (op != oend || lit != ends[STREAM_LITERALS] || off_lo != ends[STREAM_OFFSETS_LO] ||
+        off_hi != ends[STREAM_OFFSETS_HI] || len != ends[STREAM_LENGTHS]) {
+        return buf;
+    }
+
+    buf.error = 0;
+    buf.data = dst;
+    buf.size = dst_size;
+
+    return buf;
+}
+
+// Incompressible input. Already-compressed or encrypted data gains nothing from the LZ4HC
+// search and the entropy coders that follow it, which are by far the slowest part of the
+// compressor, so such blocks are detected up front and stored raw. Byte entropy is estimated
+// from evenly spaced slices of the block; only when it leaves nothing for the entropy coders,
+// the fast LZ4 compressor, which skips quickly through data without matches, checks that
+// repeated content doesn't make the block compressible after all.
+
+#define RAW_MIN_SIZE 1024
+#define RAW_SLICES 8
+#define RAW_SLICE_SIZE 2048
+
+static int block_incompressible(struct lz4huf_cctx * cctx, const uint8_t * src, uint32_t src_size) {
+    if (src_size < RAW_MIN_SIZE) {
+        return 0;
+    }
+
+    unsigned count[256] = { 0 };
+    uint32_t slice_size = src_size / RAW_SLICES < RAW_SLICE_SIZE ? src_size / RAW_SLICES : RAW_SLICE_SIZE;
+    uint32_t sampled = slice_size * RAW_SLICES;
+    for (uint32_t i = 0; i < RAW_SLICES; i++) {
+        const uint8_t * slice = src + (uint64_t)(src_size - slice_size) * i / (RAW_SLICES - 1);
+        for (uint32_t j = 0; j < slice_size; j++) {
+            count[slice[j]]++;
+        }
+    }
+
+    // Every sample falls short of 8 bits per byte a bit, so the threshold leaves some room.
+    double bits = 0;
+    for (int i = 0; i < 256; i++) {
+        if (count[i] > 0) {
+            bits += count[i] * log2((double)sampled / count[i]);
+        }
+    }
+
+    if (bits < sampled * 7.85) {
+        return 0;
+    }
+
+    int size = LZ4_compress_fast_extState(&cctx->fast, (const char *)src, (char *)cctx->lz4_buf, src_size,
+                                          sizeof(cctx->lz4_buf), 1);
+    return size <= 0 || (uint32_t)size > src_size - src_size / 32;
+}
+
+// Makes the match finder of a linked frame take in a block it didn't compress, so that the
+// blocks after it can still match into it.
+
+static void cctx_skip_block(struct lz4huf_cctx * cctx, uint8_t level, const uint8_t * src, uint32_t src_size) {
+    uint32_t kept = 0;
+    if (src_size < LZ4HUF_HISTORY) {
+        if (level < LZ4HC_CLEVEL_MIN) {
+            kept = LZ4_saveDict(&cctx->fast, (char *)cctx->history, sizeof(cctx->history));
+        } else {
+            kept = LZ4_saveDictHC(&cctx->hc, (char *)cctx->history, sizeof(cctx->history));
+        }
+
+        if (kept > LZ4HUF_HISTORY - src_size) {
+            memmove(cctx->history, cctx->history + kept - (LZ4HUF_HISTORY - src_size), LZ4HUF_HISTORY - src_size);
+            kept = LZ4HUF_HISTORY - src_size;
+        }
+    } else {
+        src += src_size - LZ4HUF_HISTORY;
+        src_size = LZ4HUF_HISTORY;
+    }
+
+    memcpy(cctx->history + kept, src, src_size);
+    cctx_load_history(cctx, level, cctx->history, kept + src_size);
+}
+
+static struct lz4huf_buffer raw_decompress(uint8_t * dst, uint32_t dst_capacity, const uint8_t * src,
+                                           uint32_t src_size) {
+    struct lz4huf_buffer buf;
+    buf.error = 1;
+    buf.data = NULL;
+    buf.size = 0;
+
+    if (src_size < 5) {
+        return buf;
+    }
+
+    uint32_t dst_size = read_u32(src + 1);
+    if (dst_size > LZ4HUF_BS || dst_size > dst_capacity) {
+        return buf;
+    }
+
+    if (src[0] == BLOCK_ZERO && src_size == 5) {
+        memset(dst, 0, dst_size);
+    } else if (src[0] == BLOCK_RLE && src_size == 6) {
+        memset(dst, src[5], dst_size);
+    } else if (src[0] == BLOCK_RAW && dst_size == src_size - 5) {
+        memcpy(dst, src + 5, dst_size);
+    } else {
+        return buf;
+    }
+
+    buf.error = 0;
+    buf.data = dst;
+    buf.size = dst_size;
+
+    return buf;
+}
+
+// Codec selection. Every block type is a codec: raw, RLE, LZ4 alone (a plain block with a stored
+// record), entropy coding alone, and LZ4 followed by entropy coding (a plain or a split block).
+// The candidates are ranked by their size plus what they cost to decode, expressed as a weight
+// per byte of output in 1/256 of a byte of compressed data, so that a slower codec has to save
+// at least that much over a faster one to be picked.
+
+enum { COST_RAW = 0, COST_LZ4 = 1, COST_ENTROPY = 3, COST_LZ4_ENTROPY = 4 };
+
+static uint64_t codec_cost(struct lz4huf_buffer buf, uint32_t src_size, int weight) {
+    if (buf.error) {
+        return UINT64_MAX;
+    }
+
+    return (uint64_t)buf.size * 256 + (uint64_t)src_size * weight;
+}
+
+// The size of the input entropy-coded on its own, estimated from its order-0 entropy plus a
+// typical table header.
+
+static uint32_t entropy_estimate(struct lz4huf_cctx * cctx, const uint8_t * src, uint32_t src_size) {
+    unsigned count[HUF_SYMBOLVALUE_MAX + 1];
+    unsigned max_symbol = HUF_SYMBOLVALUE_MAX;
+    size_t largest = HIST_count_wksp(count, &max_symbol, src, src_size, cctx->huf_wksp, sizeof(cctx->huf_wksp));
+    if (HIST_isError(largest)) {
+        return src_size;
+    }
+
+    double bits = 0;
+    for (unsigned i = 0; i <= max_symbol; i++) {
+        if (count[i] > 0) {
+            bits += count[i] * log2((double)src_size / count[i]);
+        }
+    }
+
+    return bits / 8 + 6 + 64;
+}
+
+// Zero blocks, which disk images and database files are full of. A block is OR-ed together a
+// cache line at a time, with SSE2 where it is available, and the scan stops at the first line
+// that isn't zero.
+
+static int block_is_zero(const uint8_t * src, uint32_t src_size) {
+    uint32_t i = 0;
+    for (; i + 64 <= src_size; i += 64) {
+#if defined(__SSE2__)
+        __m128i v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i *)(src + i)),
+                                              _mm_loadu_si128((const __m128i *)(src + i + 16))),
+                                 _mm_or_si128(_mm_loadu_si128((const __m128i *)(src + i + 32)),
+                                              _mm_loadu_si128((const __m128i *)(src + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xFFFF) {
+            return 0;
+        }
+#else
+        uint64_t w[8];
+        memcpy(w, src + i, sizeof(w));
+        if ((w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) != 0) {
+            return 0;
+        }
+#endif
+    }
+
+    for (; i < src_size; i++) {
+        if (src[i] != 0) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Single block compression
+
+static struct lz4huf_buffer compress_block(struct lz4huf_cctx * cctx, uint8_t * dst, uint32_t dst_capacity,
+                                           const uint8_t * src, uint32_t src_size, uint8_t level, int linked) {
+    assert(src_size <= LZ4HUF_BS && level <= 12 && level > 0);
+
+    struct lz4huf_buffer raw;
+    raw.error = dst_capacity < src_size + 5;
+    raw.data = dst;
+    raw.size = src_size + 5;
+
+    if (src_size > 0 && dst_capacity >= 5 && block_is_zero(src, src_size)) {
+        if (linked) {
+            cctx_skip_block(cctx, level, src, src_size);
+        }
+
+        dst[0] = BLOCK_ZERO;
+        write_u32(dst + 1, src_size);
+
+        raw.error = 0;
+        raw.size = 5;
+        return raw;
+    }
+
+    // A block of a single repeated byte.
+    if (src_size > 0 && dst_capacity >= 6 && memcmp(src, src + 1, src_size - 1) == 0) {
+        if (linked) {
+            cctx_skip_block(cctx, level, src, src_size);
+        }
+
+        dst[0] = BLOCK_RLE;
+        write_u32(dst + 1, src_size);
+        dst[5] = src[0];
+
+        raw.error = 0;
+        raw.size = 6;
+        return raw;
+    }
+
+    // Only the LZ4HC levels are slow enough for the check to pay off.
+    if (level >= LZ4HC_CLEVEL_MIN && !raw.error && block_incompressible(cctx, src, src_size)) {
+        if (linked) {
+            cctx_skip_block(cctx, level, src, src_size);
+        }
+
+        dst[0] = BLOCK_RAW;
+        write_u32(dst + 1, src_size);
+        memcpy(dst + 5, src, src_size);
+        return raw;
+    }
+
+    struct lz4huf_buffer buf = lz4_compress(cctx, src, src_size, level, linked);
+    if (buf.error) {
+        return buf;
+    }
+
+    // Levels that entropy-code also try the split layout.
+    struct lz4huf_buffer split;
+    split.error = 1;
+    split.data = NULL;
+    split.size = 0;
+    if (level >= 6) {
+        split = split_compress(cctx, cctx->split_buf, sizeof(cctx->split_buf), buf.data + sizeof(uint32_t),
+                               buf.size - sizeof(uint32_t), src_size, level);
+        split.error |= (uint32_t)split.size > dst_capacity;
+    }
+
+    struct lz4huf_buffer plain = entropy_compress(cctx, TABLE_PLAIN, dst, dst_capacity, buf.data, buf.size, level);
+    struct huf_table plain_table = cctx->next_tables[TABLE_PLAIN];
+    int plain_weight = plain.error || dst[0] == BLOCK_STORED ? COST_LZ4 : COST_LZ4_ENTROPY;
+    uint64_t plain_cost = codec_cost(plain, src_size, plain_weight);
+    uint64_t split_cost = codec_cost(split, src_size, COST_LZ4_ENTROPY);
+    uint64_t best_cost = plain_cost < split_cost ? plain_cost : split_cost;
+
+    // Data with few repeats can do better without LZ4, which the estimate tells before any coding
+    // is done. The block goes to the sequence buffer, which the split layout no longer needs.
+    struct lz4huf_buffer entropy;
+    entropy.error = 1;
+    entropy.data = NULL;
+    entropy.size = 0;
+    if (level >= 6 && dst_capacity > 1) {
+        uint32_t entropy_capacity = dst_capacity < sizeof(cctx->seq_buf) ? dst_capacity : sizeof(cctx->seq_buf);
+        struct lz4huf_buffer estimate;
+        estimate.error = 0;
+        estimate.size = 1 + entropy_estimate(cctx, src, src_size);
+        if (codec_cost(estimate, src_size, COST_ENTROPY) < best_cost) {
+            entropy =
+                entropy_compress(cctx, TABLE_PLAIN, cctx->seq_buf + 1, entropy_capacity - 1, src, src_size, level);
+            entropy.error |= entropy.size == 0 || cctx->seq_buf[1] == BLOCK_STORED;
+            cctx->seq_buf[0] = BLOCK_ENTROPY;
+            entropy.data = cctx->seq_buf;
+            entropy.size += 1;
+        }
+    }
+
+    uint64_t entropy_cost = codec_cost(entropy, src_size, COST_ENTROPY);
+    uint64_t raw_cost = codec_cost(raw, src_size, COST_RAW);
+    if (entropy_cost < best_cost) {
+        best_cost = entropy_cost;
+    }
+
+    if (raw_cost < best_cost) {
+        dst[0] = BLOCK_RAW;
+        write_u32(dst + 1, src_size);
+        memcpy(dst + 5, src, src_size);
+        return raw;
+    }
+
+    if (best_cost == UINT64_MAX) {
+        // Nothing fits; the plain block carries the error.
+        return plain;
+    }
+
+    if (best_cost == plain_cost) {
+        cctx->tables[TABLE_PLAIN] = plain_table;
+        return plain;
+    }
+
+    if (best_cost == entropy_cost) {
+        cctx->tables[TABLE_PLAIN] = cctx->next_tables[TABLE_PLAIN];
+        memcpy(dst, entropy.data, entropy.size);
+        entropy.data = dst;
+        return entropy;
+    }
+
+    memcpy(cctx->tables, cctx->next_tables, NUM_STREAMS * sizeof(struct huf_table));
+    memcpy(dst, split.data, split.size);
+    split.data = dst;
+
+    return split;
+}
+
+LZ4HUF_PUBLIC_API struct lz4huf_buffer lz4huf_compress_blk_chained(struct lz4huf_cctx * cctx, uint8_t * dst,
+                                                                   uint32_t dst_capacity, const uint8_t * src,
+                                                                   uint32_t src_size, uint8_t level) {
+    return compress_block(cctx, dst, dst_capacity, src, src_size, level, 0);
+}
+
+LZ4HUF_PUBLIC_API struct lz4huf_buffer lz4huf_compress_blk_linked(struct lz4huf_cctx * cctx, uint8_t * dst,
+                                                                  uint32_t dst_capacity, const uint8_t * src,
+                                                                  uint32_t src_size, uint8_t level,
+                                                                  const uint8_t * history, uint32_t history_size) {
+    cctx_load_history(cctx, level, history, history_size);
+    return compress_block(cctx, dst, dst_capacity, src, src_size, level, 1);
+}
+
+LZ4HUF_PUBLIC_API struct lz4huf_buffer lz4huf_compress_blk_into(struct lz4huf_cctx * cctx, uint8_t * dst,
+                                                                uint32_t dst_capacity, const uint8_t * src,
+                                                                uint32_t src_size, uint8_t level) {
+    cctx_start_chain(cctx);
+    return lz4huf_compress_blk_chained(cctx, dst, dst_capacity, src, src_size, level);
+}
+
+LZ4HUF_PUBLIC_API struct lz4huf_buffer lz4huf_compress_blk_ctx(struct lz4huf_cctx * cctx, const uint8_t * src,
+                                                               uint32_t src_size, uint8_t level) {
+    return lz4huf_compress_blk_into(cctx, cctx->huf_buf, sizeof(cctx->huf_buf), src, src_size, level);
+}
+
+LZ4HUF_PUBLIC_API struct lz4huf_buffer lz4huf_compress_blk(const uint8_t * src, uint32_t src_size, uint8_t level) {
+    struct lz4huf_buffer buf;
+    buf.error = 1;
+    buf.data = NULL;
+    buf.size = 0;
+
+    uint32_t dst_capacity = LZ4HUF_BLK_COMPRESSBOUND(src_size);
+    uint8_t * dst = malloc(dst_capacity);
+    struct lz4huf_cctx * cctx = lz4huf_cctx_create();
+    if (dst == NULL || cctx == NULL) {
+        free(dst);
+        lz4huf_cctx_free(cctx);
+        return buf;
+    }
+
+    buf = lz4huf_compress_blk_into(cctx, dst, dst_capacity, src, src_size, level);
+    if (buf.error) {
+        free(dst);
+    }
+
+    lz4huf_cctx_free(cctx);
+    return buf;
+}
+
+LZ4HUF_PUBLIC_API struct lz4huf_buffer lz4huf_decompress_blk_linked(struct lz4huf_dctx * dctx, uint8_t * dst,
+                                                                    uint32_t dst_capacity, const uint8_t * src,
+                                                                    uint32_t src_size, const uint8_t * history,
+                                                                    uint32_t history_size) {
+    // Only the LZ4 window matters.
+    if (history_size > LZ4HUF_HISTORY) {
+        history += history_size - LZ4HUF_HISTORY;
+        history_size = LZ4HUF_HISTORY;
+    }
+
+    if (src_size > 0 && src[0] == BLOCK_SPLIT) {
+        return split_decompress(dctx, dst, dst_capacity, src, src_size, history, history_size);
+    }
+
+    if (src_size > 0 && (src[0] == BLOCK_RAW || src[0] == BLOCK_RLE || src[0] == BLOCK_ZERO)) {
+        return raw_decompress(dst, dst_capacity, src, src_size);
+    }
+
+    // The record of an entropy block decodes straight into the output. A stored one would be a
+    // raw block, which the encoder uses instead.
+    if (src_size > 1 && src[0] == BLOCK_ENTROPY) {
+        if (src[1] == BLOCK_STORED) {
+            struct lz4huf_buffer buf;
+            buf.error = 1;
+            buf.data = NULL;
+            buf.size = 0;
+            return buf;
+        }
+
+        return entropy_decompress(dctx, TABLE_PLAIN, dst, dst_capacity, src + 1, src_size - 1);
+    }
+
+    struct lz4huf_buffer buf =
+        entropy_decompress(dctx, TABLE_PLAIN, dctx->huf_buf, sizeof(dctx->huf_buf), src, src_size);
+    if (buf.error) {
+        return buf;
+    }
+
+    return lz4_decompress(dst, dst_capacity, buf.data, buf.size, history, history_size);
+}
+
+LZ4HUF_PUBLIC_API struct lz4huf_buffer lz4huf_decompress_blk_into(struct lz4huf_dctx * dctx, uint8_t * dst,
+                                                                  uint32_t dst_capacity, const uint8_t * src,
+                                                                  uint32_t src_size) {
+    return lz4huf_decompress_blk_linked(dctx, dst, dst_capacity, src, src_size, NULL, 0);
+}
+
+LZ4HUF_PUBLIC_API struct lz4huf_buffer lz4huf_decompress_blk_ctx(struct lz4huf_dctx * dctx, const uint8_t * src,
+                                                                 uint32_t src_size) {
+    return lz4huf_decompress_blk_into(dctx, dctx->lz4_buf, sizeof(dctx->lz4_buf), src, src_size);
+}
+
+LZ4HUF_PUBLIC_API struct lz4huf_buffer lz4huf_decompress_blk(const uint8_t * src, uint32_t src_size) {
+    struct lz4huf_buffer buf;
+    buf.error = 1;
+    buf.data = NULL;
+    buf.size = 0;
+
+    uint8_t * dst = malloc(LZ4HUF_BS);
+    struct lz4huf_dctx * dctx = lz4huf_dctx_create();
+    if (dst == NULL || dctx == NULL) {
+        free(dst);
+        lz4huf_dctx_free(dctx);
+        return buf;
+    }
+
+    buf = lz4huf_decompress_blk_into(dctx, dst, LZ4HUF_BS, src, src_size);
+    if (buf.error) {
+        free(dst);
+    }
+
+    lz4huf_dctx_free(dctx);
+    return buf;
+}
+
+// Dictionaries. A small block has little to match against and can't afford a Huffman table of
+// its own, so a dictionary supplies both: up to 64 KB of content that the LZ4 stage treats as if
+// it came right before the block, and a table for the LZ4 payload that the block reuses like the
+// table of a previous block in its chain. The match finders index the content once, when the
+// dictionary is created, and only attach to it for every block. A dictionary is never modified
+// afterwards, so any number of contexts can share it.
+//
+// A serialised dictionary is:
+//
+//   magic    4 bytes  LZ4HUF_DICT_MAGIC
+//   id       4 bytes  nonzero ID of the dictionary
+//   size     4 bytes  size of the content, at most 64 KB
+//   content
+//   size     4 bytes  size of the table, 0 if there is none
+//   table             the table as written by HUF_writeCTable
+//
+// A block compressed with a dictionary is BLOCK_DICT, the ID of the dictionary as 4 bytes and a
+// regular block.
+
+#define LZ4HUF_DICT_MAGIC 0x4C344844
+
+struct lz4huf_dict {
+    uint32_t id;
+    uint32_t content_size;
+    uint8_t content[LZ4HUF_HISTORY];
+    LZ4_stream_t fast;
+    LZ4_streamHC_t hc;
+    int has_table;
+    uint32_t ctable[HUF_CTABLE_SIZE_U32(HUF_SYMBOLVALUE_MAX)];
+    HUF_DTable dtable[HUF_DTABLE_SIZE(HUF_TABLELOG_MAX)];
+};
+
+static struct lz4huf_dict * dict_alloc(uint32_t id, const uint8_t * content, uint32_t content_size) {
+    struct lz4huf_dict * dict = malloc(sizeof(struct lz4huf_dict));
+    if (dict == NULL) {
+        return NULL;
+    }
+
+    // Only the LZ4 window matters.
+    if (content_size > LZ4HUF_HISTORY) {
+        content += content_size - LZ4HUF_HISTORY;
+        content_size = LZ4HUF_HISTORY;
+    }
+
+    dict->id = id;
+    dict->content_size = content_size;
+    memcpy(dict->content, content, content_size);
+
+    // Loading indexes the content the same way at every level.
+    LZ4_initStream(&dict->fast, sizeof(dict->fast));
+    LZ4_loadDict(&dict->fast, (const char *)dict->content, content_size);
+    LZ4_initStreamHC(&dict->hc, sizeof(dict->hc));
+    LZ4_loadDictHC(&dict->hc, (const char *)dict->content, content_size);
+
+    dict->has_table = 0;
+    dict->dtable[0] = (HUF_DTable)HUF_TABLELOG_MAX * 0x01000001;
+
+    return dict;
+}
+
+// Makes the next block start a chain with the tables of the dictionary, and continue a linked
+// frame whose history is the content of the dictionary.
+
+static void cctx_attach_dict(struct lz4huf_cctx * cctx, uint8_t level, const struct lz4huf_dict * dict) {
+    cctx_start_chain(cctx);
+    cctx_start_linked(cctx, level);
+    if (level < LZ4HC_CLEVEL_MIN) {
+        LZ4_attach_dictionary(&cctx->fast, &dict->fast);
+    } else {
+        LZ4_attach_HC_dictionary(&cctx->hc, &dict->hc);
+    }
+
+    // The table covers every symbol, but Huffman still checks whether a new one would pay off.
+    if (dict->has_table) {
+        memcpy(cctx->tables[TABLE_PLAIN].ctable, dict->ctable, sizeof(dict->ctable));
+        cctx->tables[TABLE_PLAIN].repeat = HUF_repeat_check;
+    }
+}
+
+LZ4HUF_PUBLIC_API struct lz4huf_dict * lz4huf_dict_create(const uint8_t * src, uint32_t src_size) {
+    if (src_size < 16 || read_u32(src) != LZ4HUF_DICT_MAGIC || read_u32(src + 4) == 0) {
+        return NULL;
+    }
+
+    uint32_t content_size = read_u32(src + 8);
+    if (content_size > LZ4HUF_HISTORY || content_size > src_size - 16) {
+        return NULL;
+    }
+
+    uint32_t table_size = read_u32(src + 12 + content_size);
+    if (table_size != src_size - 16 - content_size) {
+        return NULL;
+    }
+
+    struct lz4huf_dict * dict = dict_alloc(read_u32(src + 4), src + 12, content_size);
+    if (dict == NULL || table_size == 0) {
+        return dict;
+    }
+
+    // The decoding table is always a single-symbol one; dictionary blocks are small. The table must
+    // cover every symbol, since a cctx reuses it for any block.
+    const uint8_t * table = src + 16 + content_size;
+    unsigned max_symbol = HUF_SYMBOLVALUE_MAX, has_zero_weights;
+    uint32_t wksp[HUF_DECOMPRESS_WORKSPACE_SIZE_U32];
+    size_t size = HUF_readCTable((HUF_CElt *)dict->ctable, &max_symbol, table, table_size, &has_zero_weights);
+    if (HUF_isError(size) || size != table_size || max_symbol != HUF_SYMBOLVALUE_MAX || has_zero_weights ||
+        HUF_isError(HUF_readDTableX1_wksp(dict->dtable, table, table_size, wksp, sizeof(wksp)))) {
+        free(dict);
+        return NULL;
+    }
+
+    dict->has_table = 1;
+
+    return dict;
+}
+
+LZ4HUF_PUBLIC_API void lz4huf_dict_free(struct lz4huf_dict * dict) { free(dict); }
+
+LZ4HUF_PUBLIC_API uint32_t lz4huf_dict_id(const struct lz4huf_dict * dict) { return dict->id; }
+
+LZ4HUF_PUBLIC_API uint32_t lz4huf_blk_dict_id(const uint8_t * src, uint32_t src_size) {
+    if (src_size < 5 || src[0] != BLOCK_DICT) {
+        return 0;
+    }
+
+    return read_u32(src + 1);
+}
+
+LZ4HUF_PUBLIC_API struct lz4huf_buffer lz4huf_compress_blk_using_dict(struct lz4huf_cctx * cctx, uint8_t * dst,
+                                                                      uint32_t dst_capacity, const uint8_t * src,
+                                                                      uint32_t src_size, uint8_t level,
+                                                                      const struct lz4huf_dict * dict) {
+    struct lz4huf_buffer buf;
+    buf.error = 1;
+    buf.data = NULL;
+    buf.size = 0;
+
+    if (dst_capacity < 5) {
+        return buf;
+    }
+
+    cctx_attach_dict(cctx, level, dict);
+    buf = compress_block(cctx, dst + 5, dst_capacity - 5, src, src_size, level, 1);
+    if (buf.error) {
+        return buf;
+    }
+
+    dst[0] = BLOCK_DICT;
+    write_u32(dst + 1, dict->id);
+
+    buf.data = dst;
+    buf.size += 5;
+
+    return buf;
+}
+
+LZ4HUF_PUBLIC_API struct lz4huf_buffer lz4huf_decompress_blk_using_dict(struct lz4huf_dctx * dctx, uint8_t * dst,
+                                                                        uint32_t dst_capacity, const uint8_t * src,
+                                                                        uint32_t src_size,
+                                                                        const struct lz4huf_dict * dict) {
+    struct lz4huf_buffer buf;
+    buf.error = 1;
+    buf.data = NULL;
+    buf.size = 0;
+
+    if (src_size > 0 && src[0] != BLOCK_DICT) {
+        return lz4huf_decompress_blk_into(dctx, dst, dst_capacity, src, src_size);
+    }
+
+    if (src_size < 5 || read_u32(src + 1) != dict->id) {
+        return buf;
+    }
+
+    src += 5;
+    src_size -= 5;
+
+    // Only a block that reuses the table needs it copied in.
+    dctx_start_chain(dctx);
+    const uint8_t * record = src_size > 1 && src[0] == BLOCK_ENTROPY ? src + 1 : src;
+    if (dict->has_table && src_size > 0 && record[0] == BLOCK_HUF_REPEAT) {
+        memcpy(dctx->dtables[TABLE_PLAIN], dict->dtable, sizeof(dict->dtable));
+        dctx->tables_loaded |= 1u << TABLE_PLAIN;
+    }
+
+    return lz4huf_decompress_blk_linked(dctx, dst, dst_capacity, src, src_size, dict->content, dict->content_size);
+}
+
+// Checksums. CRC32C, whose polynomial the SSE4.2 and ARMv8 CRC instructions implement. A single
+// stream of crc32 instructions is bound by their latency, so the hardware version runs three
+// streams over consecutive pieces of the input and joins them by shifting the CRC of the first
+// pieces over the length of the ones after them, which takes a few table lookups for a fixed
+// length. Where the instructions are missing, slicing-by-8 tables do the work. All the tables
+// are built once, on first use.
+
+#define CRC32C_POLY 0x82F63B78
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    #define CRC32C_HW_ATTR __attribute__((target("sse4.2")))
+    #define CRC32C_U8(crc, v) _mm_crc32_u8(crc, v)
+    #define CRC32C_U64(crc, v) _mm_crc32_u64(crc, v)
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    #define CRC32C_HW_ATTR
+    #define CRC32C_U8(crc, v) __crc32cb(crc, v)
+    #define CRC32C_U64(crc, v) __crc32cd(crc, v)
+#endif
+
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_x2n[32];
+static uint32_t crc32c_long[4][256], crc32c_short[4][256];
+#ifdef CRC32C_HW_ATTR
+static int crc32c_hw;
+#endif
+
+// Multiplies two polynomials modulo the CRC polynomial, in the reflected bit order.
+
+static uint32_t crc32c_multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = (uint32_t)1 << 31, p = 0;
+    while (1) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) {
+                return p;
+            }
+        }
+
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+}
+
+// x^(8 * n) modulo the CRC polynomial: the operator that runs a CRC over n zero bytes.
+
+static uint32_t crc32c_zeros(uint64_t n) {
+    uint32_t p = (uint32_t)1 << 31;
+    for (int k = 3; n > 0; n >>= 1, k++) {
+        if (n & 1) {
+            p = crc32c_multmodp(crc32c_x2n[k & 31], p);
+        }
+    }
+
+    return p;
+}
+
+static void crc32c_shift_table(uint32_t table[4][256], uint64_t n) {
+    uint32_t op = crc32c_zeros(n);
+    for (int k = 0; k < 4; k++) {
+        for (uint32_t b = 0; b < 256; b++) {
+            table[k][b] = crc32c_multmodp(op, b << (8 * k));
+        }
+    }
+}
+
+static uint32_t crc32c_shift(uint32_t table[4][256], uint32_t crc) {
+    return table[0][crc & 0xFF] ^ table[1][(crc >> 8) & 0xFF] ^ table[2][(crc >> 16) & 0xFF] ^ table[3][crc >> 24];
+}
+
+static void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+
+        crc32c_table[0][i] = crc;
+    }
+
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t crc = crc32c_table[k - 1][i];
+            crc32c_table[k][i] = (crc >> 8) ^ crc32c_table[0][crc & 0xFF];
+        }
+    }
+
+    crc32c_x2n[0] = (uint32_t)1 << 30;
+    for (int k = 1; k < 32; k++) {
+        crc32c_x2n[k] = crc32c_multmodp(crc32c_x2n[k - 1], crc32c_x2n[k - 1]);
+    }
+
+    crc32c_shift_table(crc32c_long, CRC32C_LONG);
+    crc32c_shift_table(crc32c_short, CRC32C_SHORT);
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    crc32c_hw = __builtin_cpu_supports("sse4.2");
+#elif defined(CRC32C_HW_ATTR)
+    crc32c_hw = 1;
+#endif
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t * src, size_t size) {
+    while (size > 0 && ((uintptr_t)src & 7) != 0) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *src++) & 0xFF];
+        size--;
+    }
+
+    while (size >= 8) {
+        uint32_t lo = crc ^ (src[0] | src[1] << 8 | src[2] << 16 | (uint32_t)src[3] << 24);
+        crc = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF] ^ crc32c_table[5][(lo >> 16) & 0xFF] ^
+              crc32c_table[4][lo >> 24] ^ crc32c_table[3][src[4]] ^ crc32c_table[2][src[5]] ^
+              crc32c_table[1][src[6]] ^ crc32c_table[0][src[7]];
+        src += 8;
+        size -= 8;
+    }
+
+    while (size > 0) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *src++) & 0xFF];
+        size--;
+    }
+
+    return crc;
+}
+
+#ifdef CRC32C_HW_ATTR
+CRC32C_HW_ATTR static uint32_t crc32c_hw_streams(uint32_t crc, const uint8_t * src, size_t size) {
+    while (size > 0 && ((uintptr_t)src & 7) != 0) {
+        crc = CRC32C_U8(crc, *src++);
+        size--;
+    }
+
+    // Three streams over pieces of CRC32C_LONG bytes, then of CRC32C_SHORT bytes.
+    for (size_t piece = CRC32C_LONG; piece >= CRC32C_SHORT; piece = CRC32C_SHORT) {
+        uint32_t(*table)[256] = piece == CRC32C_LONG ? crc32c_long : crc32c_short;
+        while (size >= 3 * piece) {
+            uint64_t crc0 = crc, crc1 = 0, crc2 = 0;
+            for (size_t i = 0; i < piece; i += 8) {
+                uint64_t w0, w1, w2;
+                memcpy(&w0, src + i, 8);
+                memcpy(&w1, src + piece + i, 8);
+                memcpy(&w2, src + 2 * piece + i, 8);
+                crc0 = CRC32C_U64(crc0, w0);
+                crc1 = CRC32C_U64(crc1, w1);
+                crc2 = CRC32C_U64(crc2, w2);
+            }
+
+            crc = crc32c_shift(table, crc32c_shift(table, crc0) ^ crc1) ^ crc2;
+            src += 3 * piece;
+            size -= 3 * piece;
+        }
+
+        if (piece == CRC32C_SHORT) {
+            break;
+        }
+    }
+
+    uint64_t crc64 = crc;
+    while (size >= 8) {
+        uint64_t w;
+        memcpy(&w, src, 8);
+        crc64 = CRC32C_U64(crc64, w);
+        src += 8;
+        size -= 8;
+    }
+
+    crc = crc64;
+    while (size > 0) {
+        crc = CRC32C_U8(crc, *src++);
+        size--;
+    }
+
+    return crc;
+}
+#endif
+
+LZ4HUF_PUBLIC_API uint32_t lz4huf_crc32c(uint32_t crc, const uint8_t * src, size_t src_size) {
+    pthread_once(&crc32c_once, crc32c_init);
+
+#ifdef CRC32C_HW_ATTR
+    if (crc32c_hw) {
+        return ~crc32c_hw_streams(~crc, src, src_size);
+    }
+#endif
+
+    return ~crc32c_sw(~crc, src, src_size);
+}
+
+LZ4HUF_PUBLIC_API uint32_t lz4huf_crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t size2) {
+    pthread_once(&crc32c_once, crc32c_init);
+
+    return crc32c_multmodp(crc32c_zeros(size2), crc1) ^ crc2;
+}
+
+// Frame format. A frame starts with a header:
+//
+//   magic    4 bytes  LZ4HUF_MAGIC
+//   version  1 byte   LZ4HUF_FORMAT_VERSION
+//   flags    1 byte   LZ4HUF_FLAG_*
+//   bs_log   1 byte   log2 of the block size
+//   content  8 bytes  decompressed size of the frame, present only with LZ4HUF_FLAG_CONTENT_SIZE
+//
+// followed by the blocks, each prefixed with its compressed length, and a zero length marking the
+// end of the frame. Every block but the last one decompresses to exactly the block size. The
+// blocks form chains of LZ4HUF_TABLE_CHAIN, within which they can reuse Huffman tables. With
+// LZ4HUF_FLAG_LINKED, the matches of a block can also reach into the last 64 KB of the frame
+// decoded before it. Frames can be concatenated.
+//
+// With LZ4HUF_FLAG_CHECKSUM, every block is followed by the CRC32C of its decompressed contents
+// and the end marker by the CRC32C of the decompressed contents of the frame, 4 bytes each. The
+// length prefix of a block doesn't count its checksum. The checksum of the frame is combined from
+// the ones of its blocks, so no decoder has to run over the output twice.
+//
+// With LZ4HUF_FLAG_BLOCK_INDEX, the end marker is followed by a footer with one entry per block:
+//
+//   offset   8 bytes  offset of the block's length prefix from the start of the frame
+//   size     4 bytes  decompressed size of the block
+//
+// and a trailer, which ends the frame and lets readers find the footer from the end:
+//
+//   blocks   4 bytes  number of footer entries
+//   magic    4 bytes  LZ4HUF_INDEX_MAGIC
+
+#define LZ4HUF_BS_LOG 17
+#define LZ4HUF_BS_LOG_MIN 10
+
+#define LZ4HUF_FLAGS_KNOWN \
+    (LZ4HUF_FLAG_CONTENT_SIZE | LZ4HUF_FLAG_BLOCK_INDEX | LZ4HUF_FLAG_LINKED | LZ4HUF_FLAG_CHECKSUM)
+
+#define LZ4HUF_INDEX_MAGIC 0x4C344849
+#define LZ4HUF_INDEX_ENTRY_SIZE 12
+#define LZ4HUF_INDEX_TRAILER_SIZE 8
+
+static void write_u64(uint8_t * dst, uint64_t value) {
+    write_u32(dst, value >> 32);
+    write_u32(dst + 4, value & 0xFFFFFFFF);
+}
+
+static uint64_t read_u64(const uint8_t * src) { return ((uint64_t)read_u32(src) << 32) | read_u32(src + 4); }
+
+// The size of the checksum after every block and after the end marker of a frame.
+
+static uint32_t checksum_size(uint8_t flags) { return flags & LZ4HUF_FLAG_CHECKSUM ? sizeof(uint32_t) : 0; }
+
+LZ4HUF_PUBLIC_API uint32_t lz4huf_write_frame_header(uint8_t * dst, uint32_t dst_capacity, uint8_t flags,
+                                                     uint64_t content_size) {
+    uint32_t header_size = LZ4HUF_FRAME_HEADER_MIN;
+    if (flags & LZ4HUF_FLAG_CONTENT_SIZE) {
+        header_size += sizeof(uint64_t);
+    }
+
+    if (dst_capacity < header_size) {
+        return 0;
+    }
+
+    write_u32(dst, LZ4HUF_MAGIC);
+    dst[4] = LZ4HUF_FORMAT_VERSION;
+    dst[5] = flags;
+    dst[6] = LZ4HUF_BS_LOG;
+    if (flags & LZ4HUF_FLAG_CONTENT_SIZE) {
+        write_u64(dst + LZ4HUF_FRAME_HEADER_MIN, content_size);
+    }
+
+    return header_size;
+}
+
+LZ4HUF_PUBLIC_API uint32_t lz4huf_frame_header_size(const uint8_t * src, uint32_t src_size) {
+    if (src_size < LZ4HUF_FRAME_HEADER_MIN || read_u32(src) != LZ4HUF_MAGIC || src[4] != LZ4HUF_FORMAT_VERSION) {
+        return 0;
+    }
+
+    if (src[5] & LZ4HUF_FLAG_CONTENT_SIZE) {
+        return LZ4HUF_FRAME_HEADER_MIN + sizeof(uint64_t);
+    }
+
+    return LZ4HUF_FRAME_HEADER_MIN;
+}
+
+LZ4HUF_PUBLIC_API uint8_t lz4huf_get_frame_info(struct lz4huf_frame_info * info, const uint8_t * src,
+                                                uint32_t src_size) {
+    uint32_t header_size = lz4huf_frame_header_size(src, src_size);
+    if (header_size == 0 || src_size < header_size) {
+        return 1;
+    }
+
+    // Reject flags we don't know about and block sizes our buffers can't hold.
+    uint8_t flags = src[5], bs_log = src[6];
+    if ((flags & ~LZ4HUF_FLAGS_KNOWN) || bs_log < LZ4HUF_BS_LOG_MIN || bs_log > LZ4HUF_BS_LOG) {
+        return 1;
+    }
+
+    info->flags = flags;
+    info->block_size = 1 << bs_log;
+    info->content_size = 0;
+    info->header_size = header_size;
+    if (flags & LZ4HUF_FLAG_CONTENT_SIZE) {
+        info->content_size = read_u64(src + LZ4HUF_FRAME_HEADER_MIN);
+    }
+
+    return 0;
+}
+
+// The footer is only needed for random access; check that it is there and skip it. `in_ptr`
+// points just past the end marker of a frame holding `content_size` bytes. Returns 0 on success.
+
+static int skip_footer(const struct lz4huf_frame_info * info, const uint8_t * src, uint32_t src_size,
+                       uint32_t * in_ptr, uint64_t content_size) {
+    if (!(info->flags & LZ4HUF_FLAG_BLOCK_INDEX)) {
+        return 0;
+    }
+
+    uint32_t num_blocks = (content_size + info->block_size - 1) / info->block_size;
+    uint64_t footer_size = (uint64_t)num_blocks * LZ4HUF_INDEX_ENTRY_SIZE + LZ4HUF_INDEX_TRAILER_SIZE;
+    if (footer_size > src_size - *in_ptr) {
+        return 1;
+    }
+
+    *in_ptr += footer_size;
+    if (read_u32(src + *in_ptr - 8) != num_blocks || read_u32(src + *in_ptr - 4) != LZ4HUF_INDEX_MAGIC) {
+        return 1;
+    }
+
+    return 0;
+}
+
+// The history of a linked frame, for decoders whose blocks don't end up next to each other.
+
+struct history {
+    uint8_t data[LZ4HUF_HISTORY];
+    uint32_t size;
+};
+
+static void history_append(struct history * history, const uint8_t * src, uint32_t src_size) {
+    if (src_size >= LZ4HUF_HISTORY) {
+        memcpy(history->data, src + src_size - LZ4HUF_HISTORY, LZ4HUF_HISTORY);
+        history->size = LZ4HUF_HISTORY;
+        return;
+    }
+
+    uint32_t keep = LZ4HUF_HISTORY - src_size;
+    if (keep > history->size) {
+        keep = history->size;
+    }
+
+    memmove(history->data, history->data + history->size - keep, keep);
+    memcpy(history->data + keep, src, src_size);
+    history->size = keep + src_size;
+}
+
+// Decodes the blocks of a single frame. `consumed` receives the size of the frame. The blocks
+// are decoded next to each other, so the history of a linked frame is right before each block.
+
+static struct lz4huf_buffer decompress_frame(struct lz4huf_dctx * dctx, const struct lz4huf_frame_info * info,
+                                             uint8_t * dst, uint32_t dst_capacity, const uint8_t * src,
+                                             uint32_t src_size, uint32_t * consumed) {
+    struct lz4huf_buffer buf;
+    buf.error = 1;
+    buf.data = NULL;
+    buf.size = 0;
+
+    uint32_t in_ptr = info->header_size, out_ptr = 0, num_blocks = 0, checksum = 0;
+    uint32_t trailer = checksum_size(info->flags);
+    int last_block = 0;
+    while (1) {
+        if (src_size - in_ptr < sizeof(uint32_t)) {
+            return buf;
+        }
+
+        uint32_t compressed_len = read_u32(src + in_ptr);
+        in_ptr += sizeof(uint32_t);
+        if (compressed_len == 0) {
+            break;
+        }
+
+        if (compressed_len > src_size - in_ptr || src_size - in_ptr - compressed_len < trailer || last_block) {
+            return buf;
+        }
+
+        if (num_blocks++ % LZ4HUF_TABLE_CHAIN == 0) {
+            dctx_start_chain(dctx);
+        }
+
+        uint32_t history_size = 0;
+        if (info->flags & LZ4HUF_FLAG_LINKED) {
+            history_size = out_ptr < LZ4HUF_HISTORY ? out_ptr : LZ4HUF_HISTORY;
+        }
+
+        struct lz4huf_buffer buf2 =
+            lz4huf_decompress_blk_linked(dctx, dst + out_ptr, dst_capacity - out_ptr, src + in_ptr, compressed_len,
+                                         dst + out_ptr - history_size, history_size);
+        if (buf2.error || (uint32_t)buf2.size > info->block_size) {
+            return buf;
+        }
+
+        // The block is still in cache.
+        if (trailer > 0) {
+            uint32_t block_checksum = read_u32(src + in_ptr + compressed_len);
+            if (lz4huf_crc32c(0, buf2.data, buf2.size) != block_checksum) {
+                return buf;
+            }
+
+            checksum = lz4huf_crc32c_combine(checksum, block_checksum, buf2.size);
+        }
+
+        last_block = (uint32_t)buf2.size < info->block_size;
+        in_ptr += compressed_len + trailer;
+        out_ptr += buf2.size;
+    }
+
+    if ((info->flags & LZ4HUF_FLAG_CONTENT_SIZE) && info->content_size != out_ptr) {
+        return buf;
+    }
+
+    if (trailer > 0) {
+        if (src_size - in_ptr < trailer || read_u32(src + in_ptr) != checksum) {
+            return buf;
+        }
+
+        in_ptr += trailer;
+    }
+
+    if (skip_footer(info, src, src_size, &in_ptr, out_ptr)) {
+        return buf;
+    }
+
+    *consumed = in_ptr;
+
+    buf.error = 0;
+    buf.data = dst;
+    buf.size = out_ptr;
+
+    return buf;
+}
+
+// Writes the end marker of a frame whose blocks end at `out_ptr`, followed by the checksum of
+// the frame and the footer if the frame has them. Returns the size of the frame, or 0 if it
+// doesn't fit.
+
+static uint32_t finish_frame(uint8_t * dst, uint32_t dst_capacity, uint32_t header_size, uint32_t out_ptr,
+                             uint32_t src_size, uint8_t flags, uint32_t checksum) {
+    uint32_t num_blocks = (src_size + LZ4HUF_BS - 1) / LZ4HUF_BS;
+    uint32_t trailer = checksum_size(flags);
+    uint64_t footer_size = 0;
+    if (flags & LZ4HUF_FLAG_BLOCK_INDEX) {
+        footer_size = (uint64_t)num_blocks * LZ4HUF_INDEX_ENTRY_SIZE + LZ4HUF_INDEX_TRAILER_SIZE;
+    }
+
+    if (dst_capacity - out_ptr < sizeof(uint32_t) + trailer + footer_size) {
+        return 0;
+    }
+
+    // Terminate the frame.
+    write_u32(dst + out_ptr, 0);
+    out_ptr += sizeof(uint32_t);
+    if (trailer > 0) {
+        write_u32(dst + out_ptr, checksum);
+        out_ptr += trailer;
+    }
+
+    if (flags & LZ4HUF_FLAG_BLOCK_INDEX) {
+        // The block offsets are recovered by walking the length prefixes that were just written.
+        uint32_t in_ptr = header_size;
+        for (uint32_t i = 0; i < num_blocks; i++) {
+            uint32_t block_size = LZ4HUF_BS;
+            if (i == num_blocks - 1) {
+                block_size = src_size - (num_blocks - 1) * LZ4HUF_BS;
+            }
+
+            write_u64(dst + out_ptr, in_ptr);
+            write_u32(dst + out_ptr + 8, block_size);
+            out_ptr += LZ4HUF_INDEX_ENTRY_SIZE;
+
+            in_ptr += sizeof(uint32_t) + read_u32(dst + in_ptr) + trailer;
+        }
+
+        write_u32(dst + out_ptr, num_blocks);
+        write_u32(dst + out_ptr + 4, LZ4HUF_INDEX_MAGIC);
+        out_ptr += LZ4HUF_INDEX_TRAILER_SIZE;
+    }
+
+    return out_ptr;
+}
+
+static uint64_t frame_bound(uint32_t src_size, uint8_t flags) {
+    uint64_t full_blocks = src_size / LZ4HUF_BS;
+    uint32_t tail = src_size % LZ4HUF_BS;
+
+    uint32_t trailer = checksum_size(flags);
+    uint64_t bound = LZ4HUF_FRAME_HEADER_MAX + sizeof(uint32_t) + trailer;
+    bound += full_blocks * (sizeof(uint32_t) + LZ4HUF_BLK_COMPRESSBOUND(LZ4HUF_BS) + trailer);
+    if (tail > 0) {
+        bound += sizeof(uint32_t) + LZ4HUF_BLK_COMPRESSBOUND(tail) + trailer;
+    }
+
+    if (flags & LZ4HUF_FLAG_BLOCK_INDEX) {
+        bound += (full_blocks + (tail > 0)) * LZ4HUF_INDEX_ENTRY_SIZE + LZ4HUF_INDEX_TRAILER_SIZE;
+    }
+
+    return bound;
+}
+
+// Multi block compression
+
+LZ4HUF_PUBLIC_API uint64_t lz4huf_compressBound(uint32_t src_size) { return frame_bound(src_size, 0); }
+
+static struct lz4huf_buffer compress_frame(uint8_t * dst, uint32_t dst_capacity, const uint8_t * src,
+                                           uint32_t src_size, uint8_t level, uint8_t flags) {
+    struct lz4huf_buffer buf;
+    buf.error = 1;
+    buf.data = NULL;
+    buf.size = 0;
+
+    flags |= LZ4HUF_FLAG_CONTENT_SIZE;
+
+    uint32_t header_size = lz4huf_write_frame_header(dst, dst_capacity, flags, src_size);
+    uint32_t out_ptr = header_size;
+    if (header_size == 0) {
+        return buf;
+    }
+
+    struct lz4huf_cctx * cctx = lz4huf_cctx_create();
+    if (cctx == NULL) {
+        return buf;
+    }
+
+    cctx_start_linked(cctx, level);
+
+    uint32_t trailer = checksum_size(flags), checksum = 0;
+    uint32_t num_blocks = (src_size + LZ4HUF_BS - 1) / LZ4HUF_BS;
+    for (uint32_t i = 0; i < num_blocks; i++) {
+        uint32_t block_size = LZ4HUF_BS;
+        if (i == num_blocks - 1) {
+            block_size = src_size - (num_blocks - 1) * LZ4HUF_BS;
+        }
+
+        if (dst_capacity - out_ptr < sizeof(uint32_t)) {
+            lz4huf_cctx_free(cctx);
+            return buf;
+        }
+
+        if (i % LZ4HUF_TABLE_CHAIN == 0) {
+            cctx_start_chain(cctx);
+        }
+
+        struct lz4huf_buffer buf2 =
+            compress_block(cctx, dst + out_ptr + sizeof(uint32_t), dst_capacity - out_ptr - sizeof(uint32_t),
+                           src + i * LZ4HUF_BS, block_size, level, flags & LZ4HUF_FLAG_LINKED);
+        if (buf2.error || dst_capacity - out_ptr - sizeof(uint32_t) - buf2.size < trailer) {
+            lz4huf_cctx_free(cctx);
+            return buf;
+        }
+
+        // Serialise the compressed len.
+        write_u32(dst + out_ptr, buf2.size);
+        out_ptr += sizeof(uint32_t) + buf2.size;
+
+        if (trailer > 0) {
+            uint32_t block_checksum = lz4huf_crc32c(0, src + i * LZ4HUF_BS, block_size);
+            checksum = lz4huf_crc32c_combine(checksum, block_checksum, block_size);
+            write_u32(dst + out_ptr, block_checksum);
+            out_ptr += trailer;
+        }
+    }
+
+    lz4huf_cctx_free(cctx);
+
+    out_ptr = finish_frame(dst, dst_capacity, header_size, out_ptr, src_size, flags, checksum);
+    if (out_ptr == 0) {
+        return buf;
+    }
+
+    buf.error = 0;
+    buf.data = dst;
+    buf.size = out_ptr;
+
+    return buf;
+}
+
+LZ4HUF_PUBLIC_API struct lz4huf_buffer lz4huf_compress_into(uint8_t * dst, uint32_t dst_capacity, const uint8_t * src,
+                                                            uint32_t src_size, uint8_t level) {
+    return compress_frame(dst, dst_capacity, src, src_size, level, 0);
+}
+
+LZ4HUF_PUBLIC_API struct lz4huf_buffer lz4huf_compress_ex(const uint8_t * src, uint32_t src_size, uint8_t level,
+                                                          uint8_t flags) {
+    // A frame is addressed with 32-bit offsets, so the bound of a source near 4 GB doesn't fit one.
+    uint64_t dst_capacity = frame_bound(src_size, flags);
+    uint8_t * dst = dst_capacity > UINT32_MAX ? NULL : malloc(dst_capacity);
+    if (dst == NULL) {
+        struct lz4huf_buffer buf;
+        buf.error = 1;
+        buf.data = NULL;
+        buf.size = 0;
+        return buf;
+    }
+
+    struct lz4huf_buffer buf = compress_frame(dst, dst_capacity, src, src_size, level, flags);
+    if (buf.error) {
+        free(dst);
+    }
+
+    return buf;
+}
+
+LZ4HUF_PUBLIC_API struct lz4huf_buffer lz4huf_compress(const uint8_t * src, uint32_t src_size, uint8_t level) {
+    return lz4huf_compress_ex(src, src_size, level, 0);
+}
+
+LZ4HUF_PUBLIC_API struct lz4huf_buffer lz4huf_decompress_into(uint8_t * dst, uint32_t dst_capacity, const uint8_t * src,
+                                                              uint32_t src_size) {
+    struct lz4huf_buffer buf;
+    buf.error = 1;
+    buf.data = NULL;
+    buf.size = 0;
+
+    struct lz4huf_dctx * dctx = lz4huf_dctx_create();
+    if (dctx == NULL) {
+        return buf;
+    }
+
+    uint32_t in_ptr = 0, out_ptr = 0;
+    do {
+        struct lz4huf_frame_info info;
+        if (lz4huf_get_frame_info(&info, src + in_ptr, src_size - in_ptr)) {
+            lz4huf_dctx_free(dctx);
+            return buf;
+        }
+
+        uint32_t consumed;
+        struct lz4huf_buffer buf2 = decompress_frame(dctx, &info, dst + out_ptr, dst_capacity - out_ptr,
+                                                     src + in_ptr, src_size - in_ptr, &consumed);
+        if (buf2.error) {
+            lz4huf_dctx_free(dctx);
+            return buf;
+        }
+
+        in_ptr += consumed;
+        out_ptr += buf2.size;
+    } while (in_ptr < src_size);
+
+    lz4huf_dctx_free(dctx);
+
+    buf.error = 0;
+    buf.data = dst;
+    buf.size = out_ptr;
+
+    return buf;
+}
+
+// Upper bound on the decompressed size of a frame, from the number of its blocks.
+
+static uint64_t frame_capacity(const struct lz4huf_frame_info * info, const uint8_t * src, uint32_t src_size) {
+    uint64_t num_blocks = 0, in_ptr = info->header_size;
+    while (in_ptr + sizeof(uint32_t) <= src_size) {
+        uint32_t compressed_len = read_u32(src + in_ptr);
+        if (compressed_len == 0) {
+            break;
+        }
+
+        in_ptr += sizeof(uint32_t) + compressed_len + checksum_size(info->flags);
+        num_blocks++;
+    }
+
+    return num_blocks * info->block_size;
+}
+
+LZ4HUF_PUBLIC_API struct lz4huf_buffer lz4huf_decompress(const uint8_t * src, uint32_t src_size) {
+    struct lz4huf_buffer buf;
+    buf.error = 1;
+    buf.data = NULL;
+    buf.size = 0;
+
+    struct lz4huf_dctx * dctx = lz4huf_dctx_create();
+    if (dctx == NULL) {
+        return buf;
+    }
+
+    // The output is sized from an upper bound on every frame, taken from its block lengths. A
+    // content size recorded in the header must agree with it, and then gives the exact size.
+    uint8_t * dst = NULL;
+    uint32_t in_ptr = 0, out_ptr = 0;
+    do {
+        struct lz4huf_frame_info info;
+        if (lz4huf_get_frame_info(&info, src + in_ptr, src_size - in_ptr)) {
+            break;
+        }
+
+        // Only the last block may be short.
+        uint64_t capacity = frame_capacity(&info, src + in_ptr, src_size - in_ptr);
+        if (info.flags & LZ4HUF_FLAG_CONTENT_SIZE) {
+            if (info.content_size > capacity || (capacity > 0 && info.content_size < capacity - info.block_size)) {
+                break;
+            }
+
+            capacity = info.content_size;
+        }
+
+        if (out_ptr + capacity > INT32_MAX) {
+            break;
+        }
+
+        uint8_t * new_dst = realloc(dst, out_ptr + capacity + 1);
+        if (new_dst == NULL) {
+            break;
+        }
+
+        dst = new_dst;
+
+        uint32_t consumed;
+        struct lz4huf_buffer buf2 = decompress_frame(dctx, &info, dst + out_ptr, capacity, src + in_ptr,
+                                                     src_size - in_ptr, &consumed);
+        if (buf2.error) {
+            break;
+        }
+
+        in_ptr += consumed;
+        out_ptr += buf2.size;
+
+        if (in_ptr == src_size) {
+            buf.error = 0;
+            buf.data = dst;
+            buf.size = out_ptr;
+        }
+    } while (in_ptr < src_size);
+
+    lz4huf_dctx_free(dctx);
+
+    if (buf.error) {
+        free(dst);
+    }
+
+    return buf;
+}
+
+// Streaming compression. Input is gathered into a block buffer until a whole block is
+// available, so that every block but the last one has the full block size. Blocks go straight
+// from the caller's input to the caller's output when both have room for them; otherwise the
+// compressed block waits in the stream's output buffer until the caller drains it. The memory
+// used is fixed, apart from the block index of frames that carry one.
+
+struct lz4huf_cstream {
+    struct lz4huf_cctx * cctx;
+    uint8_t level, flags;
+    int header_written;
+
+    uint8_t in_buf[LZ4HUF_BS];
+    uint32_t in_fill;
+
+    uint8_t out_buf[LZ4HUF_FRAME_HEADER_MAX + 2 * sizeof(uint32_t) + LZ4HUF_BLK_COMPRESSBOUND(LZ4HUF_BS)];
+    const uint8_t * pending;
+    uint32_t pending_size, pending_pos;
+
+    // The frame end marker followed by the checksum and the footer, built as the blocks are
+    // written. Only the end marker is used by frames without a block index and checksums.
+    uint8_t * index;
+    uint32_t num_blocks, max_blocks, trailer, checksum;
+    uint64_t frame_pos;
+};
+
+static void cstream_pend(struct lz4huf_cstream * cs, const uint8_t * data, uint32_t size) {
+    cs->pending = data;
+    cs->pending_size = size;
+    cs->pending_pos = 0;
+}
+
+LZ4HUF_PUBLIC_API struct lz4huf_cstream * lz4huf_cstream_create(uint8_t level, uint8_t flags) {
+    if (flags & ~(LZ4HUF_FLAG_BLOCK_INDEX | LZ4HUF_FLAG_LINKED | LZ4HUF_FLAG_CHECKSUM)) {
+        return NULL;
+    }
+
+    struct lz4huf_cstream * cs = malloc(sizeof(struct lz4huf_cstream));
+    if (cs == NULL) {
+        return NULL;
+    }
+
+    cs->max_blocks = 64;
+    cs->trailer = checksum_size(flags);
+    cs->cctx = lz4huf_cctx_create();
+    cs->index = malloc(sizeof(uint32_t) + cs->trailer + cs->max_blocks * LZ4HUF_INDEX_ENTRY_SIZE +
+                       LZ4HUF_INDEX_TRAILER_SIZE);
+    if (cs->cctx == NULL || cs->index == NULL) {
+        lz4huf_cctx_free(cs->cctx);
+        free(cs->index);
+        free(cs);
+        return NULL;
+    }
+
+    cs->level = level;
+    cs->flags = flags;
+    cs->header_written = 0;
+    cs->in_fill = 0;
+    cstream_pend(cs, cs->out_buf, 0);
+    cs->num_blocks = 0;
+    cs->frame_pos = 0;
+
+    return cs;
+}
+
+LZ4HUF_PUBLIC_API void lz4huf_cstream_free(struct lz4huf_cstream * cs) {
+    if (cs == NULL) {
+        return;
+    }
+
+    lz4huf_cctx_free(cs->cctx);
+    free(cs->index);
+    free(cs);
+}
+
+// Copies as much pending output as fits. Returns 1 if some is left.
+
+static int cstream_flush(struct lz4huf_cstream * cs, struct lz4huf_out_buffer * out) {
+    uint32_t n = cs->pending_size - cs->pending_pos;
+    if (n > out->size - out->pos) {
+        n = out->size - out->pos;
+    }
+
+    memcpy(out->dst + out->pos, cs->pending + cs->pending_pos, n);
+    out->pos += n;
+    cs->pending_pos += n;
+
+    return cs->pending_pos < cs->pending_size;
+}
+
+// Compresses a block into the caller's output if it has room for the worst case, or into the
+// output buffer otherwise, and records it in the index.
+
+static uint8_t cstream_block(struct lz4huf_cstream * cs, struct lz4huf_out_buffer * out, const uint8_t * src,
+                             uint32_t src_size) {
+    uint8_t * dst = cs->out_buf;
+    if (out->size - out->pos >= sizeof(uint32_t) + LZ4HUF_BLK_COMPRESSBOUND(LZ4HUF_BS) + cs->trailer) {
+        dst = out->dst + out->pos;
+    }
+
+    if (cs->num_blocks % LZ4HUF_TABLE_CHAIN == 0) {
+        cctx_start_chain(cs->cctx);
+    }
+
+    struct lz4huf_buffer buf = compress_block(cs->cctx, dst + sizeof(uint32_t), LZ4HUF_BLK_COMPRESSBOUND(LZ4HUF_BS),
+                                              src, src_size, cs->level, cs->flags & LZ4HUF_FLAG_LINKED);
+    if (buf.error) {
+        return 1;
+    }
+
+    write_u32(dst, buf.size);
+    if (cs->trailer > 0) {
+        uint32_t block_checksum = lz4huf_crc32c(0, src, src_size);
+        cs->checksum = lz4huf_crc32c_combine(cs->checksum, block_checksum, src_size);
+        write_u32(dst + sizeof(uint32_t) + buf.size, block_checksum);
+    }
+
+    if (cs->flags & LZ4HUF_FLAG_BLOCK_INDEX) {
+        if (cs->num_blocks == cs->max_blocks) {
+            uint32_t max_blocks = 2 * cs->max_blocks;
+            uint8_t * index = realloc(cs->index, sizeof(uint32_t) + cs->trailer +
+                                                     (uint64_t)max_blocks * LZ4HUF_INDEX_ENTRY_SIZE +
+                                                     LZ4HUF_INDEX_TRAILER_SIZE);
+            if (index == NULL) {
+                return 1;
+            }
+
+            cs->index = index;
+            cs->max_blocks = max_blocks;
+        }
+
+        uint8_t * entry = cs->index + sizeof(uint32_t) + cs->trailer + cs->num_blocks * LZ4HUF_INDEX_ENTRY_SIZE;
+        write_u64(entry, cs->frame_pos);
+        write_u32(entry + 8, src_size);
+    }
+
+    cs->num_blocks++;
+    cs->frame_pos += sizeof(uint32_t) + buf.size + cs->trailer;
+
+    if (dst == cs->out_buf) {
+        cstream_pend(cs, cs->out_buf, sizeof(uint32_t) + buf.size + cs->trailer);
+    } else {
+        out->pos += sizeof(uint32_t) + buf.size + cs->trailer;
+    }
+
+    return 0;
+}
+
+static void cstream_header(struct lz4huf_cstream * cs) {
+    uint32_t header_size = lz4huf_write_frame_header(cs->out_buf, sizeof(cs->out_buf), cs->flags, 0);
+    cstream_pend(cs, cs->out_buf, header_size);
+    cs->header_written = 1;
+    cs->frame_pos = header_size;
+    cs->num_blocks = 0;
+    cs->checksum = 0;
+    cctx_start_linked(cs->cctx, cs->level);
+}
+
+LZ4HUF_PUBLIC_API uint8_t lz4huf_compress_stream(struct lz4huf_cstream * cs, struct lz4huf_out_buffer * out,
+                                                 struct lz4huf_in_buffer * in) {
+    while (1) {
+        if (cstream_flush(cs, out)) {
+            return 0;
+        }
+
+        if (!cs->header_written) {
+            cstream_header(cs);
+            continue;
+        }
+
+        uint32_t available = in->size - in->pos;
+        if (cs->in_fill == 0 && available >= LZ4HUF_BS) {
+            // A whole block is available in the input; skip the block buffer.
+            if (cstream_block(cs, out, in->src + in->pos, LZ4HUF_BS)) {
+                return 1;
+            }
+
+            in->pos += LZ4HUF_BS;
+            continue;
+        }
+
+        if (available == 0) {
+            return 0;
+        }
+
+        uint32_t n = LZ4HUF_BS - cs->in_fill;
+        if (n > available) {
+            n = available;
+        }
+
+        memcpy(cs->in_buf + cs->in_fill, in->src + in->pos, n);
+        cs->in_fill += n;
+        in->pos += n;
+
+        if (cs->in_fill == LZ4HUF_BS) {
+            cs->in_fill = 0;
+            if (cstream_block(cs, out, cs->in_buf, LZ4HUF_BS)) {
+                return 1;
+            }
+        }
+    }
+}
+
+LZ4HUF_PUBLIC_API int32_t lz4huf_end_stream(struct lz4huf_cstream * cs, struct lz4huf_out_buffer * out) {
+    while (1) {
+        if (cstream_flush(cs, out)) {
+            return cs->pending_size - cs->pending_pos;
+        }
+
+        if (cs->pending == cs->index) {
+            // The end of the frame has been written; get ready for the next one.
+            cs->header_written = 0;
+            cstream_pend(cs, cs->out_buf, 0);
+            return 0;
+        }
+
+        if (!cs->header_written) {
+            cstream_header(cs);
+            continue;
+        }
+
+        if (cs->in_fill > 0) {
+            uint32_t in_fill = cs->in_fill;
+            cs->in_fill = 0;
+            if (cstream_block(cs, out, cs->in_buf, in_fill)) {
+                return -1;
+            }
+
+            continue;
+        }
+
+        // Terminate the frame, appending the checksum and the footer to the index.
+        uint32_t end_size = sizeof(uint32_t) + cs->trailer;
+        if (cs->trailer > 0) {
+            write_u32(cs->index + sizeof(uint32_t), cs->checksum);
+        }
+
+        if (cs->flags & LZ4HUF_FLAG_BLOCK_INDEX) {
+            end_size += cs->num_blocks * LZ4HUF_INDEX_ENTRY_SIZE + LZ4HUF_INDEX_TRAILER_SIZE;
+            write_u32(cs->index + end_size - 8, cs->num_blocks);
+            write_u32(cs->index + end_size - 4, LZ4HUF_INDEX_MAGIC);
+        }
+
+        write_u32(cs->index, 0);
+        cstream_pend(cs, cs->index, end_size);
+    }
+}
+
+// Streaming decompression. Every part of a frame - the header, the block lengths, the blocks
+// with their checksums, the checksum of the frame and the footer - is gathered into the input
+// buffer until it is complete, unless the caller's input holds it whole, in which case it is
+// decoded in place. Decoded blocks go straight to the caller's output when it has room for a
+// whole block; otherwise they wait in the context.
+
+enum { DSTREAM_HEADER, DSTREAM_LENGTH, DSTREAM_BLOCK, DSTREAM_CHECKSUM, DSTREAM_FOOTER };
+
+struct lz4huf_dstream {
+    struct lz4huf_dctx * dctx;
+    int stage;
+    struct lz4huf_frame_info info;
+
+    uint8_t in_buf[LZ4HUF_BLK_COMPRESSBOUND(LZ4HUF_BS) + sizeof(uint32_t)];
+    uint32_t in_fill, in_need;
+
+    const uint8_t * pending;
+    uint32_t pending_size, pending_pos;
+
+    uint64_t frame_size, num_blocks, footer_left;
+    uint32_t trailer, checksum;
+    int last_block;
+
+    struct history history;
+};
+
+static void dstream_expect(struct lz4huf_dstream * ds, int stage, uint32_t size) {
+    ds->stage = stage;
+    ds->in_fill = 0;
+    ds->in_need = size;
+}
+
+LZ4HUF_PUBLIC_API struct lz4huf_dstream * lz4huf_dstream_create(void) {
+    struct lz4huf_dstream * ds = malloc(sizeof(struct lz4huf_dstream));
+    if (ds == NULL) {
+        return NULL;
+    }
+
+    ds->dctx = lz4huf_dctx_create();
+    if (ds->dctx == NULL) {
+        free(ds);
+        return NULL;
+    }
+
+    dstream_expect(ds, DSTREAM_HEADER, LZ4HUF_FRAME_HEADER_MIN);
+    ds->pending = ds->in_buf;
+    ds->pending_size = ds->pending_pos = 0;
+
+    return ds;
+}
+
+LZ4HUF_PUBLIC_API void lz4huf_dstream_free(struct lz4huf_dstream * ds) {
+    if (ds == NULL) {
+        return;
+    }
+
+    lz4huf_dctx_free(ds->dctx);
+    free(ds);
+}
+
+// Moves input into the input buffer until it holds `in_need` bytes. Returns 1 once it does.
+
+static int dstream_gather(struct lz4huf_dstream * ds, struct lz4huf_in_buffer * in) {
+    uint32_t n = ds->in_need - ds->in_fill;
+    if (n > in->size - in->pos) {
+        n = in->size - in->pos;
+    }
+
+    memcpy(ds->in_buf + ds->in_fill, in->src + in->pos, n);
+    ds->in_fill += n;
+    in->pos += n;
+
+    return ds->in_fill == ds->in_need;
+}
+
+// Decodes a block followed by its checksum, if the frame has them.
+
+static uint8_t dstream_block(struct lz4huf_dstream * ds, struct lz4huf_out_buffer * out, const uint8_t * src,
+                             uint32_t src_size) {
+    if (ds->num_blocks % LZ4HUF_TABLE_CHAIN == 0) {
+        dctx_start_chain(ds->dctx);
+    }
+
+    src_size -= ds->trailer;
+
+    int linked = ds->info.flags & LZ4HUF_FLAG_LINKED;
+    const uint8_t * history = linked ? ds->history.data : NULL;
+    uint32_t history_size = linked ? ds->history.size : 0;
+
+    struct lz4huf_buffer buf;
+    if (out->size - out->pos >= ds->info.block_size) {
+        buf = lz4huf_decompress_blk_linked(ds->dctx, out->dst + out->pos, ds->info.block_size, src, src_size, history,
+                                           history_size);
+        if (!buf.error) {
+            out->pos += buf.size;
+        }
+    } else {
+        buf = lz4huf_decompress_blk_linked(ds->dctx, ds->dctx->lz4_buf, sizeof(ds->dctx->lz4_buf), src, src_size,
+                                           history, history_size);
+        if (!buf.error) {
+            ds->pending = buf.data;
+            ds->pending_size = buf.size;
+            ds->pending_pos = 0;
+        }
+    }
+
+    if (buf.error || (uint32_t)buf.size > ds->info.block_size) {
+        return 1;
+    }
+
+    if (ds->trailer > 0) {
+        uint32_t block_checksum = read_u32(src + src_size);
+        if (lz4huf_crc32c(0, buf.data, buf.size) != block_checksum) {
+            return 1;
+        }
+
+        ds->checksum = lz4huf_crc32c_combine(ds->checksum, block_checksum, buf.size);
+    }
+
+    if (linked) {
+        history_append(&ds->history, buf.data, buf.size);
+    }
+
+    ds->last_block = (uint32_t)buf.size < ds->info.block_size;
+    ds->frame_size += buf.size;
+    ds->num_blocks++;
+
+    return 0;
+}
+
+LZ4HUF_PUBLIC_API int32_t lz4huf_decompress_stream(struct lz4huf_dstream * ds, struct lz4huf_out_buffer * out,
+                                                   struct lz4huf_in_buffer * in) {
+    while (1) {
+        // Drain the last decoded block first.
+        uint32_t n = ds->pending_size - ds->pending_pos;
+        if (n > out->size - out->pos) {
+            n = out->size - out->pos;
+        }
+
+        memcpy(out->dst + out->pos, ds->pending + ds->pending_pos, n);
+        out->pos += n;
+        ds->pending_pos += n;
+        if (ds->pending_pos < ds->pending_size) {
+            return 1;
+        }
+
+        if (ds->stage == DSTREAM_HEADER) {
+            if (!dstream_gather(ds, in)) {
+                return ds->in_fill > 0;
+            }
+
+            uint32_t header_size = lz4huf_frame_header_size(ds->in_buf, ds->in_fill);
+            if (header_size == 0) {
+                return -1;
+            }
+
+            if (ds->in_fill < header_size) {
+                ds->in_need = header_size;
+                continue;
+            }
+
+            if (lz4huf_get_frame_info(&ds->info, ds->in_buf, ds->in_fill)) {
+                return -1;
+            }
+
+            ds->frame_size = 0;
+            ds->num_blocks = 0;
+            ds->trailer = checksum_size(ds->info.flags);
+            ds->checksum = 0;
+            ds->last_block = 0;
+            ds->history.size = 0;
+            dstream_expect(ds, DSTREAM_LENGTH, sizeof(uint32_t));
+        } else if (ds->stage == DSTREAM_LENGTH) {
+            if (!dstream_gather(ds, in)) {
+                return 1;
+            }
+
+            uint32_t compressed_len = read_u32(ds->in_buf);
+            if (compressed_len > 0) {
+                if (compressed_len > LZ4HUF_BLK_COMPRESSBOUND(ds->info.block_size) || ds->last_block) {
+                    return -1;
+                }
+
+                dstream_expect(ds, DSTREAM_BLOCK, compressed_len + ds->trailer);
+                continue;
+            }
+
+            if ((ds->info.flags & LZ4HUF_FLAG_CONTENT_SIZE) && ds->info.content_size != ds->frame_size) {
+                return -1;
+            }
+
+            if (ds->trailer > 0) {
+                dstream_expect(ds, DSTREAM_CHECKSUM, ds->trailer);
+                continue;
+            }
+
+            if (ds->info.flags & LZ4HUF_FLAG_BLOCK_INDEX) {
+                ds->footer_left = ds->num_blocks * LZ4HUF_INDEX_ENTRY_SIZE + LZ4HUF_INDEX_TRAILER_SIZE;
+                dstream_expect(ds, DSTREAM_FOOTER, LZ4HUF_INDEX_TRAILER_SIZE);
+                continue;
+            }
+
+            dstream_expect(ds, DSTREAM_HEADER, LZ4HUF_FRAME_HEADER_MIN);
+        } else if (ds->stage == DSTREAM_BLOCK) {
+            if (ds->in_fill == 0 && in->size - in->pos >= ds->in_need) {
+                // The whole block is in the input; decode it in place.
+                if (dstream_block(ds, out, in->src + in->pos, ds->in_need)) {
+                    return -1;
+                }
+
+                in->pos += ds->in_need;
+            } else {
+                if (!dstream_gather(ds, in)) {
+                    return 1;
+                }
+
+                if (dstream_block(ds, out, ds->in_buf, ds->in_fill)) {
+                    return -1;
+                }
+            }
+
+            dstream_expect(ds, DSTREAM_LENGTH, sizeof(uint32_t));
+        } else if (ds->stage == DSTREAM_CHECKSUM) {
+            if (!dstream_gather(ds, in)) {
+                return 1;
+            }
+
+            if (read_u32(ds->in_buf) != ds->checksum) {
+                return -1;
+            }
+
+            if (ds->info.flags & LZ4HUF_FLAG_BLOCK_INDEX) {
+                ds->footer_left = ds->num_blocks * LZ4HUF_INDEX_ENTRY_SIZE + LZ4HUF_INDEX_TRAILER_SIZE;
+                dstream_expect(ds, DSTREAM_FOOTER, LZ4HUF_INDEX_TRAILER_SIZE);
+                continue;
+            }
+
+            dstream_expect(ds, DSTREAM_HEADER, LZ4HUF_FRAME_HEADER_MIN);
+        } else {
+            // Only the trailer of the footer is checked; the entries are skipped.
+            uint64_t skip = ds->footer_left - LZ4HUF_INDEX_TRAILER_SIZE;
+            if (skip > in->size - in->pos) {
+                skip = in->size - in->pos;
+            }
+
+            in->pos += skip;
+            ds->footer_left -= skip;
+            if (ds->footer_left > LZ4HUF_INDEX_TRAILER_SIZE || !dstream_gather(ds, in)) {
+                return 1;
+            }
+
+            if (read_u32(ds->in_buf) != ds->num_blocks || read_u32(ds->in_buf + 4) != LZ4HUF_INDEX_MAGIC) {
+                return -1;
+            }
+
+            dstream_expect(ds, DSTREAM_HEADER, LZ4HUF_FRAME_HEADER_MIN);
+        }
+    }
+}
+
+// Random access through the block index.
+
+// Finds block `i` through its footer entry, checking that the block and its checksum lie between
+// the header and the footer. Returns NULL if they don't.
+
+static const uint8_t * index_block(const uint8_t * src, uint32_t header_size, uint32_t footer_ptr, uint32_t trailer,
+                                   uint32_t i, uint32_t * compressed_len, uint32_t * block_size) {
+    const uint8_t * entry = src + footer_ptr + (uint64_t)i * LZ4HUF_INDEX_ENTRY_SIZE;
+    uint64_t in_ptr = read_u64(entry);
+    *block_size = read_u32(entry + 8);
+    if (in_ptr < header_size || in_ptr + sizeof(uint32_t) > footer_ptr) {
+        return NULL;
+    }
+
+    *compressed_len = read_u32(src + in_ptr);
+    in_ptr += sizeof(uint32_t);
+    if ((uint64_t)*compressed_len + trailer > footer_ptr - in_ptr) {
+        return NULL;
+    }
+
+    return src + in_ptr;
+}
+
+// Loads the Huffman table a record carries, without decoding the record. Returns 1 if the
+// record is malformed or reuses a table that isn't loaded.
+
+static int load_table(struct lz4huf_dctx * dctx, int table, const uint8_t * src, uint32_t src_size) {
+    if (src_size < 5) {
+        return 1;
+    }
+
+    if (src[0] == BLOCK_HUF_REPEAT) {
+        return !(dctx->tables_loaded & (1u << table));
+    }
+
+    // A run of a single symbol has no table.
+    if (src[0] != BLOCK_HUF || src_size == 6) {
+        return 0;
+    }
+
+    // Pick the kind of decoding table the same way HUF_decompress4X_hufOnly_wksp does.
+    uint32_t dst_size = read_u32(src + 1);
+    if (dst_size == 0) {
+        return 1;
+    }
+
+    dctx->tables_loaded &= ~(1u << table);
+    size_t size;
+    if (HUF_selectDecoder(dst_size, src_size - 5)) {
+        size = HUF_readDTableX2_wksp(dctx->dtables[table], src + 5, src_size - 5, dctx->huf_wksp,
+                                     sizeof(dctx->huf_wksp));
+    } else {
+        size = HUF_readDTableX1_wksp(dctx->dtables[table], src + 5, src_size - 5, dctx->huf_wksp,
+                                     sizeof(dctx->huf_wksp));
+    }
+
+    if (HUF_isError(size)) {
+        return 1;
+    }
+
+    dctx->tables_loaded |= 1u << table;
+    return 0;
+}
+
+// Same for all the records of a block.
+
+static int load_tables(struct lz4huf_dctx * dctx, const uint8_t * src, uint32_t src_size) {
+    if (src_size > 0 && src[0] == BLOCK_ENTROPY) {
+        return load_table(dctx, TABLE_PLAIN, src + 1, src_size - 1);
+    }
+
+    if (src_size == 0 || src[0] != BLOCK_SPLIT) {
+        return load_table(dctx, TABLE_PLAIN, src, src_size);
+    }
+
+    uint32_t in_ptr = 5;
+    for (int i = 0; i < NUM_STREAMS; i++) {
+        if (src_size < in_ptr || src_size - in_ptr < sizeof(uint32_t)) {
+            return 1;
+        }
+
+        uint32_t len = read_u32(src + in_ptr);
+        in_ptr += sizeof(uint32_t);
+        if (len > src_size - in_ptr || load_table(dctx, i, src + in_ptr, len)) {
+            return 1;
+        }
+
+        in_ptr += len;
+    }
+
+    return 0;
+}
+
+LZ4HUF_PUBLIC_API struct lz4huf_buffer lz4huf_read_range(const uint8_t * src, uint32_t src_size, uint64_t offset,
+                                                         uint32_t len) {
+    struct lz4huf_buffer buf;
+    buf.error = 1;
+    buf.data = NULL;
+    buf.size = 0;
+
+    struct lz4huf_frame_info info;
+    if (lz4huf_get_frame_info(&info, src, src_size) || !(info.flags & LZ4HUF_FLAG_BLOCK_INDEX) || len > INT32_MAX) {
+        return buf;
+    }
+
+    // The trailer is at the very end of the frame and locates the footer.
+    if (src_size - info.header_size < sizeof(uint32_t) + LZ4HUF_INDEX_TRAILER_SIZE ||
+        read_u32(src + src_size - 4) != LZ4HUF_INDEX_MAGIC) {
+        return buf;
+    }
+
+    uint32_t trailer = checksum_size(info.flags);
+    uint32_t num_blocks = read_u32(src + src_size - 8);
+    uint64_t footer_size = (uint64_t)num_blocks * LZ4HUF_INDEX_ENTRY_SIZE + LZ4HUF_INDEX_TRAILER_SIZE;
+    if (footer_size + trailer > src_size - info.header_size - sizeof(uint32_t)) {
+        return buf;
+    }
+
+    uint32_t footer_ptr = src_size - footer_size;
+    uint64_t content_size = 0;
+    if (num_blocks > 0) {
+        content_size = (uint64_t)(num_blocks - 1) * info.block_size;
+        content_size += read_u32(src + footer_ptr + (num_blocks - 1) * LZ4HUF_INDEX_ENTRY_SIZE + 8);
+    }
+
+    if (offset > content_size || len > content_size - offset) {
+        return buf;
+    }
+
+    uint8_t * dst = malloc((size_t)len + 1);
+    if (dst == NULL) {
+        return buf;
+    }
+
+    struct lz4huf_dctx * dctx = lz4huf_dctx_create();
+    struct history * history = NULL;
+    if (info.flags & LZ4HUF_FLAG_LINKED) {
+        history = malloc(sizeof(struct history));
+    }
+
+    if (dctx == NULL || ((info.flags & LZ4HUF_FLAG_LINKED) && history == NULL)) {
+        lz4huf_dctx_free(dctx);
+        free(history);
+        free(dst);
+        return buf;
+    }
+
+    // The first block may reuse the tables of the blocks before it in its chain, which only need
+    // their tables loaded. In a linked frame it may also match into the blocks before it, so all
+    // of them are decoded to rebuild the history.
+    uint32_t first = offset / info.block_size;
+    int error = 0;
+    if (history != NULL) {
+        history->size = 0;
+    }
+
+    uint32_t start = history != NULL ? 0 : first - first % LZ4HUF_TABLE_CHAIN;
+    for (uint32_t i = start; i < first && len > 0 && !error; i++) {
+        if (i % LZ4HUF_TABLE_CHAIN == 0) {
+            dctx_start_chain(dctx);
+        }
+
+        uint32_t compressed_len, block_size;
+        const uint8_t * block =
+            index_block(src, info.header_size, footer_ptr, trailer, i, &compressed_len, &block_size);
+        if (block == NULL) {
+            error = 1;
+        } else if (history != NULL) {
+            struct lz4huf_buffer buf2 = lz4huf_decompress_blk_linked(dctx, dctx->lz4_buf, sizeof(dctx->lz4_buf), block,
+                                                                     compressed_len, history->data, history->size);
+            error = buf2.error || (uint32_t)buf2.size != block_size ||
+                    (trailer > 0 && lz4huf_crc32c(0, buf2.data, buf2.size) != read_u32(block + compressed_len));
+            if (!error) {
+                history_append(history, buf2.data, buf2.size);
+            }
+        } else {
+            error = load_tables(dctx, block, compressed_len);
+        }
+    }
+
+    // Blocks covered entirely by the range are decoded in place; the ones at its edges are decoded
+    // into the context and only the overlapping part is copied out.
+    uint32_t out_ptr = 0;
+    while (out_ptr < len && !error) {
+        uint64_t pos = offset + out_ptr;
+        uint32_t i = pos / info.block_size;
+        uint32_t skip = pos % info.block_size;
+
+        uint32_t compressed_len, block_size;
+        const uint8_t * block =
+            index_block(src, info.header_size, footer_ptr, trailer, i, &compressed_len, &block_size);
+        if (block == NULL || block_size > info.block_size || skip >= block_size) {
+            break;
+        }
+
+        if (i % LZ4HUF_TABLE_CHAIN == 0) {
+            dctx_start_chain(dctx);
+        }
+
+        uint32_t want = block_size - skip;
+        if (want > len - out_ptr) {
+            want = len - out_ptr;
+        }
+
+        const uint8_t * history_data = history != NULL ? history->data : NULL;
+        uint32_t history_size = history != NULL ? history->size : 0;
+
+        struct lz4huf_buffer buf2;
+        if (skip == 0 && want == block_size) {
+            buf2 = lz4huf_decompress_blk_linked(dctx, dst + out_ptr, want, block, compressed_len, history_data,
+                                                history_size);
+        } else {
+            buf2 = lz4huf_decompress_blk_linked(dctx, dctx->lz4_buf, sizeof(dctx->lz4_buf), block, compressed_len,
+                                                history_data, history_size);
+        }
+
+        if (buf2.error || (uint32_t)buf2.size != block_size) {
+            break;
+        }
+
+        // Every block is decoded whole, so its checksum is checked even if only a part is read.
+        if (trailer > 0 && lz4huf_crc32c(0, buf2.data, buf2.size) != read_u32(block + compressed_len)) {
+            break;
+        }
+
+        if (history != NULL) {
+            history_append(history, buf2.data, buf2.size);
+        }
+
+        if (buf2.data != dst + out_ptr) {
+            memcpy(dst + out_ptr, buf2.data + skip, want);
+        }
+
+        out_ptr += want;
+    }
+
+    lz4huf_dctx_free(dctx);
+    free(history);
+
+    if (out_ptr < len) {
+        free(dst);
+        return buf;
+    }
+
+    buf.error = 0;
+    buf.data = dst;
+    buf.size = len;
+
+    return buf;
+}
+
+// Thread pool. The threads are started once and sleep on a condition variable between jobs.
+// The tasks of a job are split into one contiguous range per participant; every participant
+// claims tasks from the front of its own range and, once it runs dry, steals from the others.
+// Only as many threads as there are tasks to share are woken, and the caller takes part in the
+// job itself, so a single task runs inline.
+
+struct pool_range {
+    _Atomic uint32_t next;
+    uint32_t end;
+    uint8_t padding[56];
+};
+
+struct lz4huf_pool {
+    pthread_mutex_t lock, submit;
+    pthread_cond_t wake, done;
+    pthread_t * threads;
+    uint32_t n_threads;
+    struct pool_range * ranges;
+
+    // The current job. `joined` threads have joined it so far, `inside` of them are still
+    // working, and `closed` is set once the caller has run out of tasks to claim.
+    lz4huf_task_fn task;
+    void * arg;
+    uint64_t generation;
+    uint32_t n_ranges, joined, inside;
+    int closed, shutdown;
+};
+
+static void pool_work(struct lz4huf_pool * pool, uint32_t self) {
+    for (uint32_t k = 0; k < pool->n_ranges; k++) {
+        struct pool_range * range = &pool->ranges[(self + k) % pool->n_ranges];
+        while (1) {
+            uint32_t index = atomic_fetch_add_explicit(&range->next, 1, memory_order_relaxed);
+            if (index >= range->end) {
+                break;
+            }
+
+            pool->task(pool->arg, index);
+        }
+    }
+}
+
+static void * pool_thread(void * arg) {
+    struct lz4huf_pool * pool = arg;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->generation == seen && !pool->shutdown) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+
+        if (pool->shutdown) {
+            break;
+        }
+
+        seen = pool->generation;
+        if (pool->closed || pool->joined == pool->n_ranges - 1) {
+            continue;
+        }
+
+        uint32_t self = ++pool->joined;
+        pool->inside++;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool_work(pool, self);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->inside == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+LZ4HUF_PUBLIC_API struct lz4huf_pool * lz4huf_pool_create(uint32_t threads) {
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? cpus : 1;
+    }
+
+    struct lz4huf_pool * pool = calloc(1, sizeof(struct lz4huf_pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    // The caller is one of the participants, so one thread fewer is started.
+    pool->threads = malloc(threads * sizeof(pthread_t));
+    pool->ranges = calloc(threads, sizeof(struct pool_range));
+    if (pool->threads == NULL || pool->ranges == NULL) {
+        free(pool->threads);
+        free(pool->ranges);
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_mutex_init(&pool->submit, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (uint32_t i = 0; i < threads - 1; i++) {
+        if (pthread_create(&pool->threads[i], NULL, pool_thread, pool)) {
+            lz4huf_pool_free(pool);
+            return NULL;
+        }
+
+        pool->n_threads++;
+    }
+
+    return pool;
+}
+
+LZ4HUF_PUBLIC_API void lz4huf_pool_free(struct lz4huf_pool * pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (uint32_t i = 0; i < pool->n_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->submit);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->ranges);
+    free(pool->threads);
+    free(pool);
+}
+
+LZ4HUF_PUBLIC_API void lz4huf_pool_run(void * opaque, lz4huf_task_fn task, void * arg, uint32_t n_tasks) {
+    struct lz4huf_pool * pool = opaque;
+    if (n_tasks <= 1 || pool->n_threads == 0) {
+        for (uint32_t i = 0; i < n_tasks; i++) {
+            task(arg, i);
+        }
+
+        return;
+    }
+
+    pthread_mutex_lock(&pool->submit);
+
+    uint32_t n_ranges = n_tasks < pool->n_threads + 1 ? n_tasks : pool->n_threads + 1;
+    for (uint32_t i = 0; i < n_ranges; i++) {
+        atomic_store_explicit(&pool->ranges[i].next, (uint64_t)n_tasks * i / n_ranges, memory_order_relaxed);
+        pool->ranges[i].end = (uint64_t)n_tasks * (i + 1) / n_ranges;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->arg = arg;
+    pool->n_ranges = n_ranges;
+    pool->joined = 0;
+    pool->inside = 0;
+    pool->closed = 0;
+    pool->generation++;
+    for (uint32_t i = 1; i < n_ranges; i++) {
+        pthread_cond_signal(&pool->wake);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    pool_work(pool, 0);
+
+    // Every task has been claimed; wait for the ones still running.
+    pthread_mutex_lock(&pool->lock);
+    pool->closed = 1;
+    while (pool->inside > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->submit);
+}
+
+// The executor behind lz4huf_compress_par and lz4huf_decompress_par.
+
+static void omp_executor(void * opaque, lz4huf_task_fn task, void * arg, uint32_t n_tasks) {
+    (void)opaque;
+
+#pragma omp parallel for schedule(dynamic)
+    for (int64_t i = 0; i < n_tasks; i++) {
+        task(arg, i);
+    }
+}
+
+// Tasks borrow their compression or decompression context from a per-call cache, so that no
+// more contexts are created than there are tasks running at once, whatever the executor.
+
+struct ctx_cache {
+    pthread_mutex_t lock;
+    void ** free_list;
+    uint32_t n_free;
+    int decompress;
+};
+
+static int ctx_cache_init(struct ctx_cache * cache, uint32_t n_tasks, int decompress) {
+    cache->free_list = malloc((n_tasks > 0 ? n_tasks : 1) * sizeof(void *));
+    if (cache->free_list == NULL) {
+        return 1;
+    }
+
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->n_free = 0;
+    cache->decompress = decompress;
+    return 0;
+}
+
+static void ctx_cache_destroy(struct ctx_cache * cache) {
+    for (uint32_t i = 0; i < cache->n_free; i++) {
+        if (cache->decompress) {
+            lz4huf_dctx_free(cache->free_list[i]);
+        } else {
+            lz4huf_cctx_free(cache->free_list[i]);
+        }
+    }
+
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->free_list);
+}
+
+static void * ctx_cache_get(struct ctx_cache * cache) {
+    void * ctx = NULL;
+    pthread_mutex_lock(&cache->lock);
+    if (cache->n_free > 0) {
+        ctx = cache->free_list[--cache->n_free];
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+    if (ctx == NULL) {
+        ctx = cache->decompress ? (void *)lz4huf_dctx_create() : (void *)lz4huf_cctx_create();
+    }
+
+    return ctx;
+}
+
+static void ctx_cache_put(struct ctx_cache * cache, void * ctx) {
+    pthread_mutex_lock(&cache->lock);
+    cache->free_list[cache->n_free++] = ctx;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Parallel multi block decompression. The length prefixes of a frame give the offset of every
+// block up front, and every block but the last one decompresses to exactly the block size, so
+// each block can be decoded straight into its final position in the output. A task decodes a
+// whole chain, since its blocks need the tables of the ones before them. The blocks of a linked
+// frame need the output of the ones before them, so it is decoded by a single task.
+
+struct decompress_job {
+    const struct lz4huf_frame_info * info;
+    struct ctx_cache cache;
+    const uint8_t * src;
+    const uint32_t * offsets;
+    uint32_t num_blocks, task_blocks;
+    uint8_t * dst;
+    uint64_t capacity;
+    _Atomic uint32_t last_size;
+    _Atomic int error;
+};
+
+static void decompress_task(void * arg, uint32_t task) {
+    struct decompress_job * job = arg;
+    struct lz4huf_dctx * dctx = ctx_cache_get(&job->cache);
+    if (dctx == NULL) {
+        atomic_store(&job->error, 1);
+        return;
+    }
+
+    uint32_t end = job->num_blocks;
+    if (end - task * job->task_blocks > job->task_blocks) {
+        end = (task + 1) * job->task_blocks;
+    }
+
+    for (uint32_t i = task * job->task_blocks; i < end; i++) {
+        if (i % LZ4HUF_TABLE_CHAIN == 0) {
+            dctx_start_chain(dctx);
+        }
+
+        uint64_t block_ptr = (uint64_t)i * job->info->block_size;
+        uint32_t block_capacity = job->info->block_size;
+        if (job->capacity - block_ptr < block_capacity) {
+            block_capacity = job->capacity - block_ptr;
+        }
+
+        uint32_t history_size = 0;
+        if (job->info->flags & LZ4HUF_FLAG_LINKED) {
+            history_size = block_ptr < LZ4HUF_HISTORY ? block_ptr : LZ4HUF_HISTORY;
+        }
+
+        const uint8_t * block = job->src + job->offsets[i];
+        uint32_t compressed_len = read_u32(block);
+        struct lz4huf_buffer buf =
+            lz4huf_decompress_blk_linked(dctx, job->dst + block_ptr, block_capacity, block + sizeof(uint32_t),
+                                         compressed_len, job->dst + block_ptr - history_size, history_size);
+        if (buf.error || (i < job->num_blocks - 1 && (uint32_t)buf.size != job->info->block_size)) {
+            atomic_store(&job->error, 1);
+            break;
+        }
+
+        // Every task checks its own blocks while they are in cache.
+        if ((job->info->flags & LZ4HUF_FLAG_CHECKSUM) &&
+            lz4huf_crc32c(0, buf.data, buf.size) != read_u32(block + sizeof(uint32_t) + compressed_len)) {
+            atomic_store(&job->error, 1);
+            break;
+        }
+
+        if (i == job->num_blocks - 1) {
+            atomic_store(&job->last_size, buf.size);
+        }
+    }
+
+    ctx_cache_put(&job->cache, dctx);
+}
+
+static struct lz4huf_buffer decompress_frame_par(lz4huf_executor_fn executor, void * opaque,
+                                                 const struct lz4huf_frame_info * info, uint8_t ** dst,
+                                                 uint32_t out_ptr, const uint8_t * src, uint32_t src_size,
+                                                 uint32_t * consumed) {
+    struct lz4huf_buffer buf;
+    buf.error = 1;
+    buf.data = NULL;
+    buf.size = 0;
+
+    // Collect the block offsets.
+    uint32_t * offsets = NULL;
+    uint32_t num_blocks = 0, max_blocks = 0, in_ptr = info->header_size, trailer = checksum_size(info->flags);
+    while (1) {
+        if (src_size - in_ptr < sizeof(uint32_t)) {
+            free(offsets);
+            return buf;
+        }
+
+        uint32_t compressed_len = read_u32(src + in_ptr);
+        if (compressed_len == 0) {
+            in_ptr += sizeof(uint32_t);
+            break;
+        }
+
+        if (compressed_len > src_size - in_ptr - sizeof(uint32_t) ||
+            src_size - in_ptr - sizeof(uint32_t) - compressed_len < trailer) {
+            free(offsets);
+            return buf;
+        }
+
+        if (num_blocks == max_blocks) {
+            max_blocks = max_blocks ? 2 * max_blocks : 64;
+            uint32_t * new_offsets = realloc(offsets, max_blocks * sizeof(uint32_t));
+            if (new_offsets == NULL) {
+                free(offsets);
+                return buf;
+            }
+
+            offsets = new_offsets;
+        }
+
+        offsets[num_blocks++] = in_ptr;
+        in_ptr += sizeof(uint32_t) + compressed_len + trailer;
+    }
+
+    // Only the last block may be short.
+    uint64_t capacity = (uint64_t)num_blocks * info->block_size;
+    if (info->flags & LZ4HUF_FLAG_CONTENT_SIZE) {
+        if (info->content_size > capacity || (num_blocks > 0 && info->content_size < capacity - info->block_size)) {
+            free(offsets);
+            return buf;
+        }
+
+        capacity = info->content_size;
+    }
+
+    if (out_ptr + capacity > INT32_MAX) {
+        free(offsets);
+        return buf;
+    }
+
+    uint8_t * new_dst = realloc(*dst, out_ptr + capacity + 1);
+    if (new_dst == NULL) {
+        free(offsets);
+        return buf;
+    }
+
+    *dst = new_dst;
+
+    struct decompress_job job;
+    job.info = info;
+    job.src = src;
+    job.offsets = offsets;
+    job.num_blocks = num_blocks;
+    job.task_blocks = LZ4HUF_TABLE_CHAIN;
+    if ((info->flags & LZ4HUF_FLAG_LINKED) && num_blocks > 0) {
+        job.task_blocks = num_blocks;
+    }
+
+    job.dst = new_dst + out_ptr;
+    job.capacity = capacity;
+    atomic_init(&job.last_size, 0);
+    atomic_init(&job.error, 0);
+    uint32_t num_tasks = (num_blocks + job.task_blocks - 1) / job.task_blocks;
+    if (ctx_cache_init(&job.cache, num_tasks, 1)) {
+        free(offsets);
+        return buf;
+    }
+
+    // A lone task is not worth handing to the executor.
+    if (num_tasks == 1) {
+        decompress_task(&job, 0);
+    } else if (num_tasks > 1) {
+        executor(opaque, decompress_task, &job, num_tasks);
+    }
+
+    ctx_cache_destroy(&job.cache);
+
+    uint64_t content_size = 0;
+    if (num_blocks > 0) {
+        content_size = (uint64_t)(num_blocks - 1) * info->block_size + job.last_size;
+    }
+
+    if (job.error || ((info->flags & LZ4HUF_FLAG_CONTENT_SIZE) && info->content_size != content_size)) {
+        free(offsets);
+        return buf;
+    }
+
+    // The blocks have matched their checksums, so the one of the frame is combined from them.
+    if (trailer > 0) {
+        uint32_t checksum = 0;
+        for (uint32_t i = 0; i < num_blocks; i++) {
+            const uint8_t * block = src + offsets[i];
+            uint32_t block_size = i == num_blocks - 1 ? job.last_size : info->block_size;
+            uint32_t block_checksum = read_u32(block + sizeof(uint32_t) + read_u32(block));
+            checksum = lz4huf_crc32c_combine(checksum, block_checksum, block_size);
+        }
+
+        if (src_size - in_ptr < trailer || read_u32(src + in_ptr) != checksum) {
+            free(offsets);
+            return buf;
+        }
+
+        in_ptr += trailer;
+    }
+
+    free(offsets);
+
+    if (skip_footer(info, src, src_size, &in_ptr, content_size)) {
+        return buf;
+    }
+
+    *consumed = in_ptr;
+
+    buf.error = 0;
+    buf.data = job.dst;
+    buf.size = content_size;
+
+    return buf;
+}
+
+LZ4HUF_PUBLIC_API struct lz4huf_buffer lz4huf_decompress_par_exec(lz4huf_executor_fn executor, void * opaque,
+                                                                  const uint8_t * src, uint32_t src_size) {
+    struct lz4huf_buffer buf;
+    buf.error = 1;
+    buf.data = NULL;
+    buf.size = 0;
+
+    uint8_t * dst = NULL;
+    uint32_t in_ptr = 0, out_ptr = 0;
+    do {
+        struct lz4huf_frame_info info;
+        if (lz4huf_get_frame_info(&info, src + in_ptr, src_size - in_ptr)) {
+            break;
+        }
+
+        uint32_t consumed;
+        struct lz4huf_buffer buf2 = decompress_frame_par(executor, opaque, &info, &dst, out_ptr, src + in_ptr,
+                                                         src_size - in_ptr, &consumed);
+        if (buf2.error) {
+            break;
+        }
+
+        in_ptr += consumed;
+        out_ptr += buf2.size;
+
+        if (in_ptr == src_size) {
+            buf.error = 0;
+            buf.data = dst;
+            buf.size = out_ptr;
+        }
+    } while (in_ptr < src_size);
+
+    if (buf.error) {
+        free(dst);
+    }
+
+    return buf;
+}
+
+LZ4HUF_PUBLIC_API struct lz4huf_buffer lz4huf_decompress_par(const uint8_t * src, uint32_t src_size) {
+    return lz4huf_decompress_par_exec(omp_executor, NULL, src, src_size);
+}
+
+// Parallel multi block compression. Every block gets a worst-case sized slot after the frame
+// header, prefixed with its compressed length and followed by its checksum if the frame has
+// them. The slots are compacted in place afterwards, so
+// that the output is assembled in a single allocation. A task compresses a whole chain, so that
+// its blocks can reuse the tables of the ones before them. The input is all in memory, so in a
+// linked frame a task starts from the input of the previous chain rather than waiting for it.
+
+struct compress_job {
+    struct ctx_cache cache;
+    const uint8_t * src;
+    uint32_t src_size;
+    uint32_t num_blocks;
+    uint8_t level;
+    int linked;
+    uint32_t trailer;
+    uint8_t * dst;
+    size_t slot_size;
+    _Atomic int error;
+};
+
+static void compress_task(void * arg, uint32_t chain) {
+    struct compress_job * job = arg;
+    struct lz4huf_cctx * cctx = ctx_cache_get(&job->cache);
+    if (cctx == NULL) {
+        atomic_store(&job->error, 1);
+        return;
+    }
+
+    cctx_start_chain(cctx);
+
+    uint32_t end = job->num_blocks;
+    if (end - chain * LZ4HUF_TABLE_CHAIN > LZ4HUF_TABLE_CHAIN) {
+        end = (chain + 1) * LZ4HUF_TABLE_CHAIN;
+    }
+
+    // In a linked frame, the first block of the chain matches into the input before it.
+    if (job->linked) {
+        size_t start = (size_t)chain * LZ4HUF_TABLE_CHAIN * LZ4HUF_BS;
+        uint32_t history_size = start < LZ4HUF_HISTORY ? start : LZ4HUF_HISTORY;
+        cctx_load_history(cctx, job->level, job->src + start - history_size, history_size);
+    }
+
+    for (uint32_t i = chain * LZ4HUF_TABLE_CHAIN; i < end; i++) {
+        uint32_t block_size = LZ4HUF_BS;
+        if (i == job->num_blocks - 1) {
+            block_size = job->src_size - (job->num_blocks - 1) * LZ4HUF_BS;
+        }
+
+        uint8_t * slot = job->dst + LZ4HUF_FRAME_HEADER_MAX + i * job->slot_size;
+        struct lz4huf_buffer buf =
+            compress_block(cctx, slot + sizeof(uint32_t), job->slot_size - sizeof(uint32_t) - job->trailer,
+                           job->src + (size_t)i * LZ4HUF_BS, block_size, job->level, job->linked);
+        if (buf.error) {
+            atomic_store(&job->error, 1);
+            break;
+        }
+
+        // Serialise the compressed len.
+        write_u32(slot, buf.size);
+        if (job->trailer > 0) {
+            uint32_t block_checksum = lz4huf_crc32c(0, job->src + (size_t)i * LZ4HUF_BS, block_size);
+            write_u32(slot + sizeof(uint32_t) + buf.size, block_checksum);
+        }
+    }
+
+    ctx_cache_put(&job->cache, cctx);
+}
+
+LZ4HUF_PUBLIC_API struct lz4huf_buffer lz4huf_compress_par_exec(lz4huf_executor_fn executor, void * opaque,
+                                                                const uint8_t * src, uint32_t src_size,
+                                                                uint8_t level, uint8_t flags) {
+    struct lz4huf_buffer buf;
+    buf.error = 1;
+    buf.data = NULL;
+    buf.size = 0;
+
+    uint32_t num_blocks = (src_size + LZ4HUF_BS - 1) / LZ4HUF_BS;
+
+    flags |= LZ4HUF_FLAG_CONTENT_SIZE;
+
+    // The blocks are compressed into slots, then packed into a frame that fits in its bound.
+    uint64_t bound = frame_bound(src_size, flags);
+    if (bound > UINT32_MAX) {
+        return buf;
+    }
+
+    uint32_t trailer = checksum_size(flags);
+    size_t slot_size = sizeof(uint32_t) + LZ4HUF_BLK_COMPRESSBOUND(LZ4HUF_BS) + trailer;
+    size_t dst_capacity = LZ4HUF_FRAME_HEADER_MAX + num_blocks * slot_size + sizeof(uint32_t) + trailer;
+    if (flags & LZ4HUF_FLAG_BLOCK_INDEX) {
+        dst_capacity += num_blocks * LZ4HUF_INDEX_ENTRY_SIZE + LZ4HUF_INDEX_TRAILER_SIZE;
+    }
+
+    uint8_t * dst = malloc(dst_capacity);
+    if (dst == NULL) {
+        return buf;
+    }
+
+    struct compress_job job;
+    job.src = src;
+    job.src_size = src_size;
+    job.num_blocks = num_blocks;
+    job.level = level;
+    job.linked = flags & LZ4HUF_FLAG_LINKED;
+    job.trailer = trailer;
+    job.dst = dst;
+    job.slot_size = slot_size;
+    atomic_init(&job.error, 0);
+    uint32_t num_chains = (num_blocks + LZ4HUF_TABLE_CHAIN - 1) / LZ4HUF_TABLE_CHAIN;
+    if (ctx_cache_init(&job.cache, num_chains, 0)) {
+        free(dst);
+        return buf;
+    }
+
+    // A lone chain is not worth handing to the executor.
+    if (num_chains == 1) {
+        compress_task(&job, 0);
+    } else if (num_chains > 1) {
+        executor(opaque, compress_task, &job, num_chains);
+    }
+
+    ctx_cache_destroy(&job.cache);
+
+    if (job.error) {
+        free(dst);
+        return buf;
+    }
+
+    uint32_t header_size = lz4huf_write_frame_header(dst, LZ4HUF_FRAME_HEADER_MAX, flags, src_size);
+    uint32_t out_ptr = header_size, checksum = 0;
+
+    for (uint32_t i = 0; i < num_blocks; i++) {
+        uint8_t * slot = dst + LZ4HUF_FRAME_HEADER_MAX + i * slot_size;
+        uint32_t len = sizeof(uint32_t) + read_u32(slot) + trailer;
+        if (trailer > 0) {
+            uint32_t block_size = i == num_blocks - 1 ? src_size - (num_blocks - 1) * LZ4HUF_BS : LZ4HUF_BS;
+            checksum = lz4huf_crc32c_combine(checksum, read_u32(slot + len - trailer), block_size);
+        }
+
+        memmove(dst + out_ptr, slot, len);
+        out_ptr += len;
+    }
+
+    out_ptr = finish_frame(dst, bound, header_size, out_ptr, src_size, flags, checksum);
+    if (out_ptr == 0) {
+        free(dst);
+        return buf;
+    }
+
+    buf.error = 0;
+    buf.data = dst;
+    buf.size = out_ptr;
+
+    return buf;
+}
+
+LZ4HUF_PUBLIC_API struct lz4huf_buffer lz4huf_compress_par_ex(const uint8_t * src, uint32_t src_size, uint8_t level,
+                                                              uint8_t flags) {
+    return lz4huf_compress_par_exec(omp_executor, NULL, src, src_size, level, flags);
+}
+
+LZ4HUF_PUBLIC_API struct lz4huf_buffer lz4huf_compress_par(const uint8_t * src, uint32_t src_size, uint8_t level) {
+    return lz4huf_compress_par_ex(src, src_size, level, 0);
+}
+
+// Dictionary training. The content is made of the segments of the samples whose d-mers, their
+// substrings of TRAIN_DMER bytes, are the most frequent across all of them, in the manner of the
+// COVER algorithm: the samples are cut into epochs, the best segment of every epoch becomes a
+// candidate, and the candidates are taken best first, each scored again without the d-mers that
+// the ones taken before it already cover. The table is then built from what LZ4 makes of the
+// samples with the content in front of them. The d-mer counts, the epochs and the statistics of
+// the table are all computed in parallel, with every task working on a slice of the samples.
+
+#define TRAIN_DMER 8
+#define TRAIN_SEGMENT 256
+#define TRAIN_HASH_LOG 20
+#define TRAIN_TASKS 256
+
+// Runs of a single byte would make the best segments out of padding; they get no d-mer.
+
+static int train_dmer(const uint8_t * src, uint32_t * hash) {
+    uint64_t value;
+    memcpy(&value, src, sizeof(value));
+    if (value == (value & 0xFF) * 0x0101010101010101ull) {
+        return 0;
+    }
+
+    *hash = (value * 0x9E3779B97F4A7C15ull) >> (64 - TRAIN_HASH_LOG);
+    return 1;
+}
+
+struct train_candidate {
+    uint64_t start;
+    uint64_t score;
+};
+
+struct train_job {
+    const uint8_t * samples;
+    const uint32_t * sample_sizes;
+    const uint64_t * offsets;
+    uint32_t num_samples;
+
+    _Atomic uint32_t * counts;
+    uint64_t epoch_size;
+    struct train_candidate * candidates;
+
+    const struct lz4huf_dict * dict;
+    struct ctx_cache cache;
+    pthread_mutex_t lock;
+    uint64_t totals[HUF_SYMBOLVALUE_MAX + 1];
+    _Atomic int error;
+};
+
+// The samples are laid out one after the other, so a slice of them is a range of offsets. Finds
+// the sample holding offset `pos`.
+
+static uint32_t train_find_sample(const struct train_job * job, uint64_t pos) {
+    uint32_t lo = 0, hi = job->num_samples;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (job->offsets[mid] <= pos) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+static void train_slice(const struct train_job * job, uint32_t task, uint64_t * lo, uint64_t * hi) {
+    uint64_t total = job->offsets[job->num_samples];
+    *lo = total * task / TRAIN_TASKS;
+    *hi = total * (task + 1) / TRAIN_TASKS;
+}
+
+// Counts the samples every d-mer occurs in, so that the structure all samples share wins over
+// whatever repeats within a few of them. A sample longer than a block counts as one per block, the
+// most that LZ4 looks at at once. The d-mers of a block starting in a slice are counted by the task
+// of the slice; those crossing into the next sample are not counted at all. `seen` records the
+// block every d-mer was last counted for.
+
+static void train_count_task(void * arg, uint32_t task) {
+    struct train_job * job = arg;
+    uint32_t * seen = calloc(1u << TRAIN_HASH_LOG, sizeof(uint32_t));
+    if (seen == NULL) {
+        atomic_store(&job->error, 1);
+        return;
+    }
+
+    uint64_t lo, hi;
+    train_slice(job, task, &lo, &hi);
+
+    uint32_t num_blocks = 0;
+    for (uint32_t i = train_find_sample(job, lo); lo < hi && i < job->num_samples; i++) {
+        for (uint32_t in_ptr = 0; in_ptr < job->sample_sizes[i]; in_ptr += LZ4HUF_BS) {
+            if (job->offsets[i] + in_ptr < lo || job->offsets[i] + in_ptr >= hi) {
+                continue;
+            }
+
+            uint32_t size = job->sample_sizes[i] - in_ptr;
+            if (size > LZ4HUF_BS) {
+                size = LZ4HUF_BS;
+            }
+
+            num_blocks++;
+            const uint8_t * block = job->samples + job->offsets[i] + in_ptr;
+            for (uint32_t pos = 0; pos + TRAIN_DMER <= size; pos++) {
+                uint32_t hash;
+                if (train_dmer(block + pos, &hash) && seen[hash] != num_blocks) {
+                    seen[hash] = num_blocks;
+                    atomic_fetch_add_explicit(&job->counts[hash], 1, memory_order_relaxed);
+                }
+            }
+        }
+
+        lo = job->offsets[i] + job->sample_sizes[i];
+    }
+
+    free(seen);
+}
+
+// Finds the segment of an epoch whose d-mers are the most frequent, sliding a window over it.
+
+static void train_epoch_task(void * arg, uint32_t epoch) {
+    struct train_job * job = arg;
+    uint64_t lo = epoch * job->epoch_size;
+    uint64_t hi = lo + job->epoch_size;
+
+    uint64_t score = 0;
+    struct train_candidate best = { lo, 0 };
+    for (uint64_t pos = lo; pos + TRAIN_DMER <= hi; pos++) {
+        uint32_t hash;
+        if (train_dmer(job->samples + pos, &hash)) {
+            score += atomic_load_explicit(&job->counts[hash], memory_order_relaxed);
+        }
+
+        // The window holds the d-mers starting in the segment ending at `pos + TRAIN_DMER`.
+        if (pos >= lo + TRAIN_SEGMENT - TRAIN_DMER + 1) {
+            uint64_t first = pos - (TRAIN_SEGMENT - TRAIN_DMER + 1);
+            if (train_dmer(job->samples + first, &hash)) {
+                score -= atomic_load_explicit(&job->counts[hash], memory_order_relaxed);
+            }
+        }
+
+        if (pos >= lo + TRAIN_SEGMENT - TRAIN_DMER && score > best.score) {
+            best.start = pos + TRAIN_DMER - TRAIN_SEGMENT;
+            best.score = score;
+        }
+    }
+
+    job->candidates[epoch] = best;
+}
+
+// Adds up the symbols of the LZ4 payloads of the blocks starting in a slice.
+
+static void train_table_task(void * arg, uint32_t task) {
+    struct train_job * job = arg;
+    struct lz4huf_cctx * cctx = ctx_cache_get(&job->cache);
+    if (cctx == NULL) {
+        atomic_store(&job->error, 1);
+        return;
+    }
+
+    uint64_t lo, hi;
+    train_slice(job, task, &lo, &hi);
+
+    uint64_t totals[HUF_SYMBOLVALUE_MAX + 1] = { 0 };
+    for (uint32_t i = train_find_sample(job, lo); lo < hi && i < job->num_samples; i++) {
+        for (uint32_t in_ptr = 0; in_ptr < job->sample_sizes[i]; in_ptr += LZ4HUF_BS) {
+            if (job->offsets[i] + in_ptr < lo || job->offsets[i] + in_ptr >= hi) {
+                continue;
+            }
+
+            uint32_t size = job->sample_sizes[i] - in_ptr;
+            if (size > LZ4HUF_BS) {
+                size = LZ4HUF_BS;
+            }
+
+            cctx_attach_dict(cctx, LZ4HC_CLEVEL_DEFAULT, job->dict);
+            struct lz4huf_buffer payload =
+                lz4_compress(cctx, job->samples + job->offsets[i] + in_ptr, size, LZ4HC_CLEVEL_DEFAULT, 1);
+            if (payload.error) {
+                continue;
+            }
+
+            unsigned count[HUF_SYMBOLVALUE_MAX + 1];
+            unsigned max_symbol = HUF_SYMBOLVALUE_MAX;
+            HIST_count_simple(count, &max_symbol, payload.data, payload.size);
+            for (unsigned j = 0; j <= max_symbol; j++) {
+                totals[j] += count[j];
+            }
+        }
+
+        lo = job->offsets[i] + job->sample_sizes[i];
+    }
+
+    ctx_cache_put(&job->cache, cctx);
+
+    pthread_mutex_lock(&job->lock);
+    for (int i = 0; i <= HUF_SYMBOLVALUE_MAX; i++) {
+        job->totals[i] += totals[i];
+    }
+
+    pthread_mutex_unlock(&job->lock);
+}
+
+// Builds the table of a dictionary from the samples. Every symbol gets a code, so that the table
+// can code any block. Returns the size of the description written to `table`, or 0 if there are no
+// samples to build it from.
+
+static size_t train_table(struct train_job * job, struct lz4huf_dict * dict, uint8_t * table,
+                          uint32_t table_capacity) {
+    job->dict = dict;
+    memset(job->totals, 0, sizeof(job->totals));
+    atomic_init(&job->error, 0);
+    if (job->offsets[job->num_samples] == 0 || ctx_cache_init(&job->cache, TRAIN_TASKS, 0)) {
+        return 0;
+    }
+
+    pthread_mutex_init(&job->lock, NULL);
+    omp_executor(NULL, train_table_task, job, TRAIN_TASKS);
+    pthread_mutex_destroy(&job->lock);
+
+    struct lz4huf_cctx * cctx = ctx_cache_get(&job->cache);
+    if (cctx == NULL || atomic_load(&job->error)) {
+        if (cctx != NULL) {
+            ctx_cache_put(&job->cache, cctx);
+        }
+
+        ctx_cache_destroy(&job->cache);
+        return 0;
+    }
+
+    uint64_t max_total = 0;
+    for (int i = 0; i <= HUF_SYMBOLVALUE_MAX; i++) {
+        if (job->totals[i] > max_total) {
+            max_total = job->totals[i];
+        }
+    }
+
+    int shift = 0;
+    while ((max_total >> shift) >= (1u << 24)) {
+        shift++;
+    }
+
+    unsigned count[HUF_SYMBOLVALUE_MAX + 1];
+    for (int i = 0; i <= HUF_SYMBOLVALUE_MAX; i++) {
+        count[i] = 1 + (unsigned)(job->totals[i] >> shift);
+    }
+
+    size_t size = HUF_buildCTable_wksp((HUF_CElt *)dict->ctable, count, HUF_SYMBOLVALUE_MAX, HUF_TABLELOG_DEFAULT,
+                                       cctx->huf_wksp, sizeof(cctx->huf_wksp));
+    if (!HUF_isError(size)) {
+        size = HUF_writeCTable(table, table_capacity, (HUF_CElt *)dict->ctable, HUF_SYMBOLVALUE_MAX, size);
+    }
+
+    ctx_cache_put(&job->cache, cctx);
+    ctx_cache_destroy(&job->cache);
+
+    return HUF_isError(size) ? 0 : size;
+}
+
+static uint64_t * train_offsets(const uint32_t * sample_sizes, uint32_t num_samples) {
+    uint64_t * offsets = malloc(((size_t)num_samples + 1) * sizeof(uint64_t));
+    if (offsets == NULL) {
+        return NULL;
+    }
+
+    offsets[0] = 0;
+    for (uint32_t i = 0; i < num_samples; i++) {
+        offsets[i + 1] = offsets[i] + sample_sizes[i];
+    }
+
+    return offsets;
+}
+
+static struct lz4huf_buffer dict_serialise(const struct lz4huf_dict * dict, const uint8_t * table,
+                                           uint32_t table_size) {
+    struct lz4huf_buffer buf;
+    buf.error = 1;
+    buf.data = NULL;
+    buf.size = 0;
+
+    uint32_t size = 16 + dict->content_size + table_size;
+    buf.data = malloc(size);
+    if (buf.data == NULL) {
+        return buf;
+    }
+
+    write_u32(buf.data, LZ4HUF_DICT_MAGIC);
+    write_u32(buf.data + 4, dict->id);
+    write_u32(buf.data + 8, dict->content_size);
+    memcpy(buf.data + 12, dict->content, dict->content_size);
+    write_u32(buf.data + 12 + dict->content_size, table_size);
+    memcpy(buf.data + 16 + dict->content_size, table, table_size);
+
+    buf.error = 0;
+    buf.size = size;
+
+    return buf;
+}
+
+LZ4HUF_PUBLIC_API struct lz4huf_buffer lz4huf_dict_build(const uint8_t * content, uint32_t content_size,
+                                                         const uint8_t * samples, const uint32_t * sample_sizes,
+                                                         uint32_t num_samples, uint32_t id) {
+    struct lz4huf_buffer buf;
+    buf.error = 1;
+    buf.data = NULL;
+    buf.size = 0;
+
+    if (id == 0) {
+        return buf;
+    }
+
+    struct train_job job;
+    job.samples = samples;
+    job.sample_sizes = sample_sizes;
+    job.offsets = train_offsets(sample_sizes, num_samples);
+    job.num_samples = num_samples;
+    struct lz4huf_dict * dict = dict_alloc(id, content, content_size);
+    if (job.offsets == NULL || dict == NULL) {
+        free((void *)job.offsets);
+        free(dict);
+        return buf;
+    }
+
+    uint8_t table[HUF_CTABLEBOUND];
+    size_t table_size = train_table(&job, dict, table, sizeof(table));
+    buf = dict_serialise(dict, table, table_size);
+
+    free((void *)job.offsets);
+    free(dict);
+
+    return buf;
+}
+
+static int train_compare(const void * a, const void * b) {
+    const struct train_candidate * x = a;
+    const struct train_candidate * y = b;
+    return (x->score < y->score) - (x->score > y->score);
+}
+
+// Takes the candidates best first into the content, which is filled from the end, so that the
+// best segments end up closest to the data. Returns the size of the content.
+
+static uint32_t train_select(struct train_job * job, uint32_t num_candidates, uint8_t * content,
+                             uint32_t content_capacity) {
+    uint8_t * used = calloc((1u << TRAIN_HASH_LOG) / 8, 1);
+    if (used == NULL) {
+        return 0;
+    }
+
+    qsort(job->candidates, num_candidates, sizeof(struct train_candidate), train_compare);
+
+    uint32_t out_ptr = content_capacity;
+    for (uint32_t i = 0; i < num_candidates && out_ptr >= TRAIN_DMER; i++) {
+        uint32_t len = out_ptr < TRAIN_SEGMENT ? out_ptr : TRAIN_SEGMENT;
+        const uint8_t * segment = job->samples + job->candidates[i].start;
+
+        // Score the segment again, counting every d-mer not covered yet once.
+        uint32_t added[TRAIN_SEGMENT];
+        uint32_t num_added = 0;
+        uint64_t score = 0;
+        for (uint32_t pos = 0; pos + TRAIN_DMER <= len; pos++) {
+            uint32_t hash;
+            if (train_dmer(segment + pos, &hash) && !(used[hash / 8] & (1u << (hash % 8)))) {
+                used[hash / 8] |= 1u << (hash % 8);
+                added[num_added++] = hash;
+                score += atomic_load_explicit(&job->counts[hash], memory_order_relaxed);
+            }
+        }
+
+        // A segment covered by the ones before it would only take up room.
+        if (score == 0) {
+            for (uint32_t j = 0; j < num_added; j++) {
+                used[added[j] / 8] &= ~(1u << (added[j] % 8));
+            }
+
+            continue;
+        }
+
+        out_ptr -= len;
+        memcpy(content + out_ptr, segment, len);
+    }
+
+    free(used);
+
+    memmove(content, content + out_ptr, content_capacity - out_ptr);
+    return content_capacity - out_ptr;
+}
+
+LZ4HUF_PUBLIC_API struct lz4huf_buffer lz4huf_train_dictionary(const uint8_t * samples, const uint32_t * sample_sizes,
+                                                               uint32_t num_samples, uint32_t dict_capacity) {
+    struct lz4huf_buffer buf;
+    buf.error = 1;
+    buf.data = NULL;
+    buf.size = 0;
+
+    if (dict_capacity > LZ4HUF_HISTORY) {
+        dict_capacity = LZ4HUF_HISTORY;
+    }
+
+    struct train_job job;
+    job.samples = samples;
+    job.sample_sizes = sample_sizes;
+    job.offsets = train_offsets(sample_sizes, num_samples);
+    job.num_samples = num_samples;
+    job.counts = calloc(1u << TRAIN_HASH_LOG, sizeof(_Atomic uint32_t));
+    uint8_t * content = malloc(dict_capacity > 0 ? dict_capacity : 1);
+    if (job.offsets == NULL || job.counts == NULL || content == NULL) {
+        free((void *)job.offsets);
+        free((void *)job.counts);
+        free(content);
+        return buf;
+    }
+
+    // Samples that fit, or are too small to pick segments from, are taken whole.
+    uint64_t total = job.offsets[num_samples];
+    uint32_t content_size;
+    if (total <= dict_capacity || total < TRAIN_SEGMENT) {
+        content_size = total < dict_capacity ? total : dict_capacity;
+        memcpy(content, samples + total - content_size, content_size);
+    } else {
+        // Leave a choice of a few candidates for every segment that fits.
+        uint64_t num_epochs = 4 * (uint64_t)dict_capacity / TRAIN_SEGMENT + 1;
+        if (num_epochs > total / TRAIN_SEGMENT) {
+            num_epochs = total / TRAIN_SEGMENT;
+        }
+
+        job.epoch_size = total / num_epochs;
+        job.candidates = malloc(num_epochs * sizeof(struct train_candidate));
+        if (job.candidates == NULL) {
+            free((void *)job.offsets);
+            free((void *)job.counts);
+            free(content);
+            return buf;
+        }
+
+        atomic_init(&job.error, 0);
+        omp_executor(NULL, train_count_task, &job, TRAIN_TASKS);
+        omp_executor(NULL, train_epoch_task, &job, num_epochs);
+        content_size = train_select(&job, num_epochs, content, dict_capacity);
+        free(job.candidates);
+
+        if (atomic_load(&job.error)) {
+            free((void *)job.offsets);
+            free((void *)job.counts);
+            free(content);
+            return buf;
+        }
+    }
+
+    struct lz4huf_dict * dict = dict_alloc(1, content, content_size);
+    free(content);
+    if (dict == NULL) {
+        free((void *)job.offsets);
+        free((void *)job.counts);
+        return buf;
+    }
+
+    uint8_t table[HUF_CTABLEBOUND];
+    size_t table_size = train_table(&job, dict, table, sizeof(table));
+    buf = dict_serialise(dict, table, table_size);
+
+    free((void *)job.offsets);
+    free((void *)job.counts);
+    free(dict);
+
+    if (buf.error) {
+        return buf;
+    }
+
+    // The ID is a hash of the rest of the dictionary (FNV-1a), so that different dictionaries are
+    // unlikely to share one.
+    uint32_t id = 2166136261u;
+    write_u32(buf.data + 4, 0);
+    for (int32_t i = 0; i < buf.size; i++) {
+        id = (id ^ buf.data[i]) * 16777619u;
+    }
+
+    write_u32(buf.data + 4, id != 0 ? id : 1);
 
     return buf;
 }
@@ -4,12 +4,14 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <omp.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 
 #ifdef __linux__
+    #include <fcntl.h>
     #include <unistd.h>
 #endif
 
@@ -44,11 +46,16 @@ static void help() {
             "Operations:\n"
             "  -e/-z, --encode   compress data (default)\n"
             "  -d, --decode      decompress data\n"
+            "  -t, --test        test the integrity of compressed data on all cores\n"
             "  -h, --help        display an usage overview\n"
             "  -f, --force       force overwriting output if it already exists\n"
             "  -v, --verbose     verbose mode (display more information)\n"
             "  -V, --version     display version information\n"
             "  -p, --parallel    perform parallel compression/decompression\n"
+            "  -l, --linked      let blocks refer to the data before them (better ratio)\n"
+            "  -C, --checksum    add checksums of the data, verified when decompressing\n"
+            "  --train           train a dictionary on the given files, write it to stdout\n"
+            "  --maxdict=N       limit the dictionary content to N bytes (default: 65536)\n"
             "  -1..-12           set compression level (default: 9)\n"
             "\n"
             "Examples:\n"
@@ -71,126 +78,710 @@ static int is_dir(const char * path) {
     return 0;
 }
 
-enum { MODE_COMPRESS, MODE_EXPAND };
+enum { MODE_COMPRESS, MODE_EXPAND, MODE_TEST, MODE_TRAIN };
 
-static void process(int mode, const char * in_name, FILE * input, FILE * output, int force,
-                    int verbose, int jobs, int level) {
-    if (mode == MODE_COMPRESS) {
-        size_t total_read = 0, total_written = 0;
-        if (jobs == 1) {
-            size_t n_read = 0;
-            char * buffer = malloc(32 * 1024 * 1024);
-            if (!buffer) {
-                fprintf(stderr, "lz4huf: memory exhausted\n");
+// The size of the input and output buffers used with the streaming API.
+#define CLI_STREAM_BUF (1024 * 1024)
+
+// Pipelined parallel compression. A reader thread fills a ring of slots, the workers compress
+// them as they become available and the calling thread writes them out in order, so that I/O
+// overlaps with compression and no thread waits for a whole batch to finish. A slot holds a
+// chain of blocks, which share their Huffman tables. The output is a single frame without the
+// content size. In a linked frame, the reader also copies the last 64 KB of the previous chain in
+// front of the slot, so that the slot can be compressed without waiting for it. With checksums,
+// the worker also combines the checksums of the blocks of its chain, and the writer those of the
+// chains into the checksum of the frame.
+
+#define CLI_HISTORY (64 * 1024)
+#define CLI_CHAIN_SIZE (LZ4HUF_TABLE_CHAIN * LZ4HUF_BS)
+#define CLI_CHAIN_BOUND (LZ4HUF_TABLE_CHAIN * (8 + LZ4HUF_BLK_COMPRESSBOUND(LZ4HUF_BS)))
+
+static uint32_t load_u32(const uint8_t * src) {
+    return (uint32_t)src[0] << 24 | (uint32_t)src[1] << 16 | (uint32_t)src[2] << 8 | src[3];
+}
+
+static void store_u32(uint8_t * dst, uint32_t value) {
+    dst[0] = value >> 24;
+    dst[1] = value >> 16;
+    dst[2] = value >> 8;
+    dst[3] = value;
+}
+
+enum { SLOT_FREE, SLOT_READ, SLOT_BUSY, SLOT_DONE };
+
+struct slot {
+    int state;
+    uint8_t * in;
+    uint32_t in_size, history_size;
+    uint8_t * out;
+    int32_t out_size;
+    uint32_t checksum;
+};
+
+struct pipeline {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct slot * slots;
+    size_t n_slots;
+    FILE * input;
+    int level, flags;
+
+    // Sequence numbers of the next chain to read, compress and write; `eof` is the number of
+    // chains in the input once the reader has seen its end.
+    size_t next_read, next_compress, next_write;
+    size_t eof;
+};
+
+static void * pipeline_reader(void * arg) {
+    struct pipeline * p = arg;
+    while (1) {
+        pthread_mutex_lock(&p->lock);
+        struct slot * slot = &p->slots[p->next_read % p->n_slots];
+        while (slot->state != SLOT_FREE) pthread_cond_wait(&p->cond, &p->lock);
+        pthread_mutex_unlock(&p->lock);
+
+        // The previous chain is full, and its slot is not reused before this one is read.
+        slot->history_size = 0;
+        if ((p->flags & LZ4HUF_FLAG_LINKED) && p->next_read > 0) {
+            struct slot * prev = &p->slots[(p->next_read - 1) % p->n_slots];
+            memcpy(slot->in, prev->in + CLI_HISTORY + prev->in_size - CLI_HISTORY, CLI_HISTORY);
+            slot->history_size = CLI_HISTORY;
+        }
+
+        size_t n_read = fread(slot->in + CLI_HISTORY, 1, CLI_CHAIN_SIZE, p->input);
+        if (ferror(p->input)) {
+            fprintf(stderr, "lz4huf: read error: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        pthread_mutex_lock(&p->lock);
+        if (n_read > 0) {
+            slot->in_size = n_read;
+            slot->state = SLOT_READ;
+            p->next_read++;
+        }
+
+        if (n_read < CLI_CHAIN_SIZE) {
+            p->eof = p->next_read;
+        }
+
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+
+        if (n_read < CLI_CHAIN_SIZE) {
+            return NULL;
+        }
+    }
+}
+
+static void * pipeline_worker(void * arg) {
+    struct pipeline * p = arg;
+    struct lz4huf_cctx * cctx = lz4huf_cctx_create();
+    if (!cctx) {
+        fprintf(stderr, "lz4huf: memory exhausted\n");
+        exit(1);
+    }
+
+    while (1) {
+        pthread_mutex_lock(&p->lock);
+        struct slot * slot;
+        while (1) {
+            if (p->next_compress == p->eof) {
+                pthread_mutex_unlock(&p->lock);
+                lz4huf_cctx_free(cctx);
+                return NULL;
+            }
+
+            slot = &p->slots[p->next_compress % p->n_slots];
+            if (p->next_compress < p->next_read && slot->state == SLOT_READ) break;
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+
+        slot->state = SLOT_BUSY;
+        p->next_compress++;
+        pthread_mutex_unlock(&p->lock);
+
+        // Every block is written with its length prefix and its checksum, so that the slot can be
+        // written out as-is.
+        int32_t out_size = 0;
+        uint32_t checksum = 0;
+        uint8_t * in = slot->in + CLI_HISTORY;
+        for (uint32_t in_ptr = 0; in_ptr < slot->in_size; in_ptr += LZ4HUF_BS) {
+            uint32_t block_size = slot->in_size - in_ptr < LZ4HUF_BS ? slot->in_size - in_ptr : LZ4HUF_BS;
+            uint8_t * out = slot->out + out_size;
+            struct lz4huf_buffer b;
+            if (p->flags & LZ4HUF_FLAG_LINKED) {
+                uint32_t history_size = in_ptr > 0 ? CLI_HISTORY : slot->history_size;
+                if (in_ptr == 0) lz4huf_cctx_start_chain(cctx);
+                b = lz4huf_compress_blk_linked(cctx, out + 4, LZ4HUF_BLK_COMPRESSBOUND(LZ4HUF_BS), in + in_ptr,
+                                               block_size, p->level, in + in_ptr - history_size, history_size);
+            } else if (in_ptr == 0) {
+                b = lz4huf_compress_blk_into(cctx, out + 4, LZ4HUF_BLK_COMPRESSBOUND(LZ4HUF_BS), in, block_size,
+                                             p->level);
+            } else {
+                b = lz4huf_compress_blk_chained(cctx, out + 4, LZ4HUF_BLK_COMPRESSBOUND(LZ4HUF_BS), in + in_ptr,
+                                                block_size, p->level);
+            }
+
+            if (b.error) {
+                fprintf(stderr, "lz4huf: compression failed\n");
                 exit(1);
             }
 
-            while ((n_read = fread(buffer, 1, 32 * 1024 * 1024, input)) > 0) {
-                struct lz4huf_buffer b = lz4huf_compress(buffer, n_read, level);
-                if (b.size == 0) {
-                    fprintf(stderr, "lz4huf: compression failed\n");
+            store_u32(out, b.size);
+            out_size += 4 + b.size;
+
+            if (p->flags & LZ4HUF_FLAG_CHECKSUM) {
+                uint32_t block_checksum = lz4huf_crc32c(0, in + in_ptr, block_size);
+                checksum = lz4huf_crc32c_combine(checksum, block_checksum, block_size);
+                store_u32(out + 4 + b.size, block_checksum);
+                out_size += 4;
+            }
+        }
+
+        pthread_mutex_lock(&p->lock);
+        slot->out_size = out_size;
+        slot->checksum = checksum;
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+static void write_all(const void * data, size_t size, FILE * output) {
+    if (fwrite(data, 1, size, output) != size) {
+        fprintf(stderr, "lz4huf: write error: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+// Sparse output. When decompressing into a regular file, runs of zero pages are seeked over
+// instead of written, which leaves holes in the file, and a file that ends in a hole is extended
+// to its full size once everything is written. The output must be positioned at its end, so that
+// the seeks only pass over space that the file doesn't hold yet, rather than over old data that
+// would be left in place. `hole` is NULL when the output can't be sparse, and otherwise tells
+// whether the output ends in a hole.
+
+#define CLI_SPARSE_PAGE 4096
+
+static int sparse_output(FILE * output) {
+#ifdef __linux__
+    struct stat st;
+    int flags = fcntl(fileno(output), F_GETFL);
+    if (fflush(output) || fstat(fileno(output), &st) || !S_ISREG(st.st_mode) || flags == -1 || (flags & O_APPEND)) {
+        return 0;
+    }
+
+    return ftello(output) == st.st_size;
+#else
+    (void)output;
+    return 0;
+#endif
+}
+
+static int page_is_zero(const uint8_t * data, size_t size) {
+    return data[0] == 0 && memcmp(data, data + 1, size - 1) == 0;
+}
+
+static void write_sparse(const uint8_t * data, size_t size, FILE * output, int * hole) {
+    if (!hole) {
+        write_all(data, size, output);
+        return;
+    }
+
+#ifdef __linux__
+    while (size > 0) {
+        // Take the longest run of pages that are all zero, or all not.
+        size_t run = size < CLI_SPARSE_PAGE ? size : CLI_SPARSE_PAGE;
+        int zero = page_is_zero(data, run);
+        while (run < size) {
+            size_t page = size - run < CLI_SPARSE_PAGE ? size - run : CLI_SPARSE_PAGE;
+            if (page_is_zero(data + run, page) != zero) break;
+            run += page;
+        }
+
+        if (zero) {
+            if (fseeko(output, run, SEEK_CUR)) {
+                fprintf(stderr, "lz4huf: seek error: %s\n", strerror(errno));
+                exit(1);
+            }
+        } else {
+            write_all(data, run, output);
+        }
+
+        *hole = zero;
+        data += run;
+        size -= run;
+    }
+#endif
+}
+
+static void end_sparse(FILE * output, int * hole) {
+#ifdef __linux__
+    if (!hole || !*hole) {
+        return;
+    }
+
+    struct stat st;
+    off_t end = ftello(output);
+    if (fflush(output) || fstat(fileno(output), &st) || end < 0 ||
+        (st.st_size < end && ftruncate(fileno(output), end))) {
+        fprintf(stderr, "lz4huf: write error: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    *hole = 0;
+#else
+    (void)output;
+    (void)hole;
+#endif
+}
+
+static void compress_pipelined(FILE * input, FILE * output, int jobs, int level, int flags, size_t * total_read,
+                               size_t * total_written) {
+    struct pipeline p;
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+    p.n_slots = 2 * jobs;
+    p.input = input;
+    p.level = level;
+    p.flags = flags;
+    p.next_read = p.next_compress = p.next_write = 0;
+    p.eof = SIZE_MAX;
+
+    p.slots = calloc(p.n_slots, sizeof(struct slot));
+    if (!p.slots) {
+        fprintf(stderr, "lz4huf: memory exhausted\n");
+        exit(1);
+    }
+
+    for (size_t i = 0; i < p.n_slots; i++) {
+        p.slots[i].in = malloc(CLI_HISTORY + CLI_CHAIN_SIZE);
+        p.slots[i].out = malloc(CLI_CHAIN_BOUND);
+        if (!p.slots[i].in || !p.slots[i].out) {
+            fprintf(stderr, "lz4huf: memory exhausted\n");
+            exit(1);
+        }
+    }
+
+    uint8_t header[LZ4HUF_FRAME_HEADER_MAX];
+    uint32_t header_size = lz4huf_write_frame_header(header, sizeof(header), flags, 0);
+    write_all(header, header_size, output);
+    *total_written += header_size;
+
+    pthread_t reader, * workers = malloc(jobs * sizeof(pthread_t));
+    if (!workers) {
+        fprintf(stderr, "lz4huf: memory exhausted\n");
+        exit(1);
+    }
+
+    if (pthread_create(&reader, NULL, pipeline_reader, &p)) {
+        fprintf(stderr, "lz4huf: cannot create thread\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < jobs; i++) {
+        if (pthread_create(&workers[i], NULL, pipeline_worker, &p)) {
+            fprintf(stderr, "lz4huf: cannot create thread\n");
+            exit(1);
+        }
+    }
+
+    // Write the chains in order and hand their slots back to the reader.
+    uint32_t checksum = 0;
+    while (1) {
+        pthread_mutex_lock(&p.lock);
+        struct slot * slot = &p.slots[p.next_write % p.n_slots];
+        while (p.next_write != p.eof && !(p.next_write < p.next_read && slot->state == SLOT_DONE)) {
+            pthread_cond_wait(&p.cond, &p.lock);
+        }
+
+        int done = p.next_write == p.eof;
+        pthread_mutex_unlock(&p.lock);
+        if (done) break;
+
+        write_all(slot->out, slot->out_size, output);
+        *total_read += slot->in_size;
+        *total_written += slot->out_size;
+        checksum = lz4huf_crc32c_combine(checksum, slot->checksum, slot->in_size);
+
+        pthread_mutex_lock(&p.lock);
+        slot->state = SLOT_FREE;
+        p.next_write++;
+        pthread_cond_broadcast(&p.cond);
+        pthread_mutex_unlock(&p.lock);
+    }
+
+    // Terminate the frame.
+    uint8_t end[8] = { 0, 0, 0, 0 };
+    uint32_t end_size = 4;
+    if (flags & LZ4HUF_FLAG_CHECKSUM) {
+        store_u32(end + 4, checksum);
+        end_size += 4;
+    }
+
+    write_all(end, end_size, output);
+    *total_written += end_size;
+
+    pthread_join(reader, NULL);
+    for (int i = 0; i < jobs; i++) pthread_join(workers[i], NULL);
+
+    for (size_t i = 0; i < p.n_slots; i++) {
+        free(p.slots[i].in);
+        free(p.slots[i].out);
+    }
+
+    free(workers);
+    free(p.slots);
+    pthread_cond_destroy(&p.cond);
+    pthread_mutex_destroy(&p.lock);
+}
+
+// The blocks of a linked frame can match into the last 64 KB decoded before them, which are kept
+// across windows.
+
+static void keep_history(uint8_t * history, uint32_t * history_size, const uint8_t * src, uint32_t src_size) {
+    if (src_size >= CLI_HISTORY) {
+        memcpy(history, src + src_size - CLI_HISTORY, CLI_HISTORY);
+        *history_size = CLI_HISTORY;
+        return;
+    }
+
+    uint32_t keep = CLI_HISTORY - src_size;
+    if (keep > *history_size) keep = *history_size;
+    memmove(history, history + *history_size - keep, keep);
+    memcpy(history + keep, src, src_size);
+    *history_size = keep + src_size;
+}
+
+// Parallel decompression. Blocks are read a window at a time and the window is decoded on all
+// threads, one context per thread. The window holds a chain per thread, and a chain is decoded
+// in order by one thread, since its blocks reuse the Huffman tables of the ones before them, and
+// the thread checks the checksums of the blocks it decodes. Linked frames are decoded in order on
+// the calling thread. When testing, `output` is NULL and the decoded data is dropped.
+
+#define CLI_BLOCK_SLOT (LZ4HUF_BLK_COMPRESSBOUND(LZ4HUF_BS) + 4)
+
+static void expand_windowed(const char * in_name, FILE * input, FILE * output, int * hole, int jobs,
+                            size_t * total_read, size_t * total_written) {
+    int window = jobs * LZ4HUF_TABLE_CHAIN;
+    uint8_t * compressed = malloc((size_t)window * CLI_BLOCK_SLOT);
+    uint8_t * decompressed = malloc((size_t)window * LZ4HUF_BS);
+    uint32_t * compressed_lens = malloc(window * sizeof(uint32_t));
+    int32_t * decompressed_lens = malloc(window * sizeof(int32_t));
+    struct lz4huf_dctx ** dctx = calloc(jobs, sizeof(struct lz4huf_dctx *));
+    uint8_t * history = malloc(CLI_HISTORY);
+    if (!compressed || !decompressed || !compressed_lens || !decompressed_lens || !dctx || !history) {
+        fprintf(stderr, "lz4huf: memory exhausted\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < jobs; i++) {
+        dctx[i] = lz4huf_dctx_create();
+        if (!dctx[i]) {
+            fprintf(stderr, "lz4huf: memory exhausted\n");
+            exit(1);
+        }
+    }
+
+    // Loop on the frames.
+    while (1) {
+        unsigned char header[LZ4HUF_FRAME_HEADER_MAX];
+        size_t nread = fread(header, 1, LZ4HUF_FRAME_HEADER_MIN, input);
+        if (nread == 0) {
+            break;
+        }
+
+        uint32_t header_size = lz4huf_frame_header_size(header, nread);
+        if (header_size == 0) {
+            fprintf(stderr, "lz4huf: %s: not in lz4huf format\n", in_name);
+            exit(1);
+        }
+
+        if (fread(header + nread, 1, header_size - nread, input) != header_size - nread) {
+            fprintf(stderr, "lz4huf: read error: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        struct lz4huf_frame_info info;
+        if (lz4huf_get_frame_info(&info, header, header_size)) {
+            fprintf(stderr, "lz4huf: %s: unsupported frame parameters\n", in_name);
+            exit(1);
+        }
+
+        *total_read += header_size;
+
+        // Loop on the windows.
+        uint32_t trailer = (info.flags & LZ4HUF_FLAG_CHECKSUM) ? 4 : 0, checksum = 0;
+        uint32_t history_size = 0;
+        uint64_t frame_written = 0, frame_blocks = 0;
+        int last_block = 0, end_of_frame = 0;
+        while (!end_of_frame) {
+            // Read up to a window of blocks.
+            int n_blocks = 0;
+            while (n_blocks < window) {
+                // Read the compressed length.
+                unsigned char num[4];
+                if (fread(num, 1, 4, input) != 4) {
+                    fprintf(stderr, "lz4huf: read error: %s\n",
+                            feof(input) ? "unexpected end of file" : strerror(errno));
                     exit(1);
                 }
-                if (fwrite(b.data, 1, b.size, output) != b.size) {
-                    fprintf(stderr, "lz4huf: write error: %s\n", strerror(errno));
+
+                *total_read += 4;
+
+                uint32_t compressed_len = load_u32(num);
+
+                if (compressed_len == 0) {
+                    end_of_frame = 1;
+                    break;
+                }
+
+                if (compressed_len > LZ4HUF_BLK_COMPRESSBOUND(LZ4HUF_BS)) {
+                    fprintf(stderr, "lz4huf: corrupted input\n");
                     exit(1);
                 }
-                total_read += n_read;
-                total_written += b.size;
-                free(b.data);
+
+                // Read the compressed data and its checksum.
+                uint8_t * slot = compressed + (size_t)n_blocks * CLI_BLOCK_SLOT;
+                if (fread(slot, 1, compressed_len + trailer, input) != compressed_len + trailer) {
+                    fprintf(stderr, "lz4huf: read error: %s\n",
+                            feof(input) ? "unexpected end of file" : strerror(errno));
+                    exit(1);
+                }
+
+                *total_read += compressed_len + trailer;
+                compressed_lens[n_blocks++] = compressed_len;
             }
 
-            free(buffer);
-        } else {
-            size_t n_read = 0;
-            char * buffer = malloc(jobs * LZ4HUF_BS);
-            if (!buffer) {
-                fprintf(stderr, "lz4huf: memory exhausted\n");
-                exit(1);
+            // Decompress the window.
+            if (info.flags & LZ4HUF_FLAG_LINKED) {
+                for (int i = 0; i < n_blocks; i++) {
+                    const uint8_t * src = compressed + (size_t)i * CLI_BLOCK_SLOT;
+                    if (i % LZ4HUF_TABLE_CHAIN == 0) lz4huf_dctx_start_chain(dctx[0]);
+                    struct lz4huf_buffer b =
+                        lz4huf_decompress_blk_linked(dctx[0], decompressed + (size_t)i * LZ4HUF_BS, info.block_size,
+                                                     src, compressed_lens[i], history, history_size);
+                    if (!b.error && trailer && lz4huf_crc32c(0, b.data, b.size) != load_u32(src + compressed_lens[i])) {
+                        b.error = 1;
+                    }
+
+                    decompressed_lens[i] = b.error ? -1 : b.size;
+                    if (b.error) break;
+                    keep_history(history, &history_size, b.data, b.size);
+                }
             }
 
-            while ((n_read = fread(buffer, 1, jobs * LZ4HUF_BS, input)) > 0) {
-                struct lz4huf_buffer b = lz4huf_compress_par(buffer, n_read, level);
-                if (b.size == 0) {
-                    fprintf(stderr, "lz4huf: compression failed\n");
-                    exit(1);
+            int n_chains = (n_blocks + LZ4HUF_TABLE_CHAIN - 1) / LZ4HUF_TABLE_CHAIN;
+            if (info.flags & LZ4HUF_FLAG_LINKED) n_chains = 0;
+#pragma omp parallel for num_threads(jobs) schedule(dynamic) if (n_chains > 1)
+            for (int c = 0; c < n_chains; c++) {
+                lz4huf_dctx_start_chain(dctx[omp_get_thread_num()]);
+                for (int i = c * LZ4HUF_TABLE_CHAIN; i < n_blocks && i < (c + 1) * LZ4HUF_TABLE_CHAIN; i++) {
+                    const uint8_t * src = compressed + (size_t)i * CLI_BLOCK_SLOT;
+                    struct lz4huf_buffer b =
+                        lz4huf_decompress_blk_into(dctx[omp_get_thread_num()], decompressed + (size_t)i * LZ4HUF_BS,
+                                                   info.block_size, src, compressed_lens[i]);
+                    if (!b.error && trailer && lz4huf_crc32c(0, b.data, b.size) != load_u32(src + compressed_lens[i])) {
+                        b.error = 1;
+                    }
+
+                    decompressed_lens[i] = b.error ? -1 : b.size;
                 }
-                if (fwrite(b.data, 1, b.size, output) != b.size) {
-                    fprintf(stderr, "lz4huf: write error: %s\n", strerror(errno));
+            }
+
+            // Write the decompressed data, in order. Only the last block of a frame may be short.
+            for (int i = 0; i < n_blocks; i++) {
+                if (decompressed_lens[i] < 0 || last_block) {
+                    fprintf(stderr, "lz4huf: decompression failed\n");
                     exit(1);
                 }
-                total_read += n_read;
-                total_written += b.size;
-                free(b.data);
+
+                last_block = (uint32_t)decompressed_lens[i] < info.block_size;
+                if (trailer) {
+                    uint32_t block_checksum = load_u32(compressed + (size_t)i * CLI_BLOCK_SLOT + compressed_lens[i]);
+                    checksum = lz4huf_crc32c_combine(checksum, block_checksum, decompressed_lens[i]);
+                }
+
+                if (output) write_sparse(decompressed + (size_t)i * LZ4HUF_BS, decompressed_lens[i], output, hole);
+
+                *total_written += decompressed_lens[i];
+                frame_written += decompressed_lens[i];
             }
 
-            free(buffer);
-        }
-        if (verbose) {
-            fprintf(stderr, "%s\t%" PRIu64 " -> %" PRIu64 " bytes, %.2f%%, %.2f bpb\n", in_name, total_read, total_written,
-                    (double)total_written * 100.0 / total_read, (double)total_written * 8.0 / total_read);
+            frame_blocks += n_blocks;
         }
-    } else {
-        size_t total_read = 0, total_written = 0;
 
-        char * compressed = malloc(LZ4HUF_BS + 256);
-        if (!compressed) {
-            fprintf(stderr, "lz4huf: memory exhausted\n");
+        if ((info.flags & LZ4HUF_FLAG_CONTENT_SIZE) && frame_written != info.content_size) {
+            fprintf(stderr, "lz4huf: decompression failed: frame size mismatch\n");
             exit(1);
         }
 
-        // Loop on the blocks.
-        while (!feof(input)) {
-            uint32_t compressed_len = 0;
-
-            // Read the compressed length.
+        if (trailer) {
             unsigned char num[4];
-            size_t nread = fread(num, 1, 4, input);
-            if (nread == 0) {
-                break;
+            if (fread(num, 1, 4, input) != 4) {
+                fprintf(stderr, "lz4huf: read error: %s\n", feof(input) ? "unexpected end of file" : strerror(errno));
+                exit(1);
             }
 
-            if (nread != 4) {
-                fprintf(stderr, "lz4huf: read error: %s\n", strerror(errno));
+            *total_read += 4;
+            if (load_u32(num) != checksum) {
+                fprintf(stderr, "lz4huf: decompression failed: checksum mismatch\n");
                 exit(1);
             }
+        }
 
-            total_read += 4;
+        // The block index is of no use when decoding sequentially; skip it.
+        if (info.flags & LZ4HUF_FLAG_BLOCK_INDEX) {
+            uint64_t footer_size = frame_blocks * 12 + 8;
+            *total_read += footer_size;
+            while (footer_size > 0) {
+                size_t chunk = LZ4HUF_BLK_COMPRESSBOUND(LZ4HUF_BS);
+                if (chunk > footer_size) chunk = footer_size;
+                if (fread(compressed, 1, chunk, input) != chunk) {
+                    fprintf(stderr, "lz4huf: read error: %s\n",
+                            feof(input) ? "unexpected end of file" : strerror(errno));
+                    exit(1);
+                }
 
-            compressed_len |= num[0] << 24;
-            compressed_len |= num[1] << 16;
-            compressed_len |= num[2] << 8;
-            compressed_len |= num[3];
+                footer_size -= chunk;
+            }
+        }
+    }
 
-            if (compressed_len == 0) break;
+    for (int i = 0; i < jobs; i++) {
+        lz4huf_dctx_free(dctx[i]);
+    }
 
-            // Read the compressed data.
-            if (fread(compressed, 1, compressed_len, input) != compressed_len) {
-                fprintf(stderr, "lz4huf: read error: %s\n", strerror(errno));
+    free(history);
+    free(dctx);
+    free(decompressed_lens);
+    free(compressed_lens);
+    free(decompressed);
+    free(compressed);
+}
+
+// Sequential decompression, through the streaming API.
+
+static void expand_stream(FILE * input, FILE * output, int * hole, size_t * total_read, size_t * total_written) {
+    uint8_t * buffer = malloc(2 * CLI_STREAM_BUF);
+    struct lz4huf_dstream * ds = lz4huf_dstream_create();
+    if (!buffer || !ds) {
+        fprintf(stderr, "lz4huf: memory exhausted\n");
+        exit(1);
+    }
+
+    size_t n_read;
+    int32_t ret = 0;
+    struct lz4huf_out_buffer out = { buffer + CLI_STREAM_BUF, CLI_STREAM_BUF, 0 };
+    while ((n_read = fread(buffer, 1, CLI_STREAM_BUF, input)) > 0) {
+        struct lz4huf_in_buffer in = { buffer, n_read, 0 };
+        do {
+            out.pos = 0;
+            ret = lz4huf_decompress_stream(ds, &out, &in);
+            if (ret < 0) {
+                fprintf(stderr, "lz4huf: decompression failed\n");
                 exit(1);
             }
 
-            total_read += compressed_len;
+            write_sparse(out.dst, out.pos, output, hole);
+            *total_written += out.pos;
+        } while (in.pos < in.size || out.pos == out.size);
 
-            // Decompress the data.
-            struct lz4huf_buffer b = lz4huf_decompress_blk(compressed, compressed_len);
-            if (b.error) {
-                fprintf(stderr, "lz4huf: decompression failed\n");
+        *total_read += n_read;
+    }
+
+    if (ferror(input)) {
+        fprintf(stderr, "lz4huf: read error: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    if (ret != 0) {
+        fprintf(stderr, "lz4huf: read error: unexpected end of file\n");
+        exit(1);
+    }
+
+    lz4huf_dstream_free(ds);
+    free(buffer);
+}
+
+static void process(int mode, const char * in_name, FILE * input, FILE * output, int force,
+                    int verbose, int jobs, int level, int flags) {
+    if (mode == MODE_COMPRESS) {
+        size_t total_read = 0, total_written = 0;
+        if (jobs == 1) {
+            size_t n_read = 0;
+            uint8_t * buffer = malloc(2 * CLI_STREAM_BUF);
+            struct lz4huf_cstream * cs = lz4huf_cstream_create(level, flags);
+            if (!buffer || !cs) {
+                fprintf(stderr, "lz4huf: memory exhausted\n");
                 exit(1);
             }
 
-            // Write the decompressed data.
-            if (fwrite(b.data, 1, b.size, output) != b.size) {
-                fprintf(stderr, "lz4huf: write error: %s\n", strerror(errno));
+            struct lz4huf_out_buffer out = { buffer + CLI_STREAM_BUF, CLI_STREAM_BUF, 0 };
+            while ((n_read = fread(buffer, 1, CLI_STREAM_BUF, input)) > 0) {
+                struct lz4huf_in_buffer in = { buffer, n_read, 0 };
+                while (in.pos < in.size) {
+                    out.pos = 0;
+                    if (lz4huf_compress_stream(cs, &out, &in)) {
+                        fprintf(stderr, "lz4huf: compression failed\n");
+                        exit(1);
+                    }
+
+                    write_all(out.dst, out.pos, output);
+                    total_written += out.pos;
+                }
+
+                total_read += n_read;
+            }
+
+            if (ferror(input)) {
+                fprintf(stderr, "lz4huf: read error: %s\n", strerror(errno));
                 exit(1);
             }
 
-            total_written += b.size;
+            int32_t left;
+            do {
+                out.pos = 0;
+                left = lz4huf_end_stream(cs, &out);
+                if (left < 0) {
+                    fprintf(stderr, "lz4huf: compression failed\n");
+                    exit(1);
+                }
+
+                write_all(out.dst, out.pos, output);
+                total_written += out.pos;
+            } while (left > 0);
+
+            lz4huf_cstream_free(cs);
+            free(buffer);
+        } else {
+            compress_pipelined(input, output, jobs, level, flags, &total_read, &total_written);
+        }
+        if (verbose) {
+            fprintf(stderr, "%s\t%" PRIu64 " -> %" PRIu64 " bytes, %.2f%%, %.2f bpb\n", in_name, total_read, total_written,
+                    (double)total_written * 100.0 / total_read, (double)total_written * 8.0 / total_read);
+        }
+    } else if (mode == MODE_TEST) {
+        // Every core decodes a chain of blocks of the window, no matter the number of jobs.
+        size_t total_read = 0, total_written = 0;
+        expand_windowed(in_name, input, NULL, NULL, omp_get_max_threads(), &total_read, &total_written);
+
+        if (verbose) {
+            fprintf(stderr, "%s\t%" PRIu64 " <- %" PRIu64 " bytes, OK\n", in_name, total_written, total_read);
+        }
+    } else {
+        size_t total_read = 0, total_written = 0;
+        int ends_in_hole = 0;
+        int * hole = sparse_output(output) ? &ends_in_hole : NULL;
 
-            free(b.data);
+        if (jobs == 1) {
+            expand_stream(input, output, hole, &total_read, &total_written);
+        } else {
+            expand_windowed(in_name, input, output, hole, jobs, &total_read, &total_written);
         }
 
-        free(compressed);
+        end_sparse(output, hole);
 
         if (verbose) {
             fprintf(stderr, "%s\t%" PRIu64 " <- %" PRIu64 " bytes, %.2f%%, %.2f bpb\n", in_name, total_written, total_read,
@@ -199,6 +790,73 @@ static void process(int mode, const char * in_name, FILE * input, FILE * output,
     }
 }
 
+// Dictionary training. Every file is a sample.
+
+static void train(char ** files, int n_files, uint32_t capacity, int verbose) {
+    uint8_t * samples = NULL;
+    uint32_t * sample_sizes = malloc((n_files > 0 ? n_files : 1) * sizeof(uint32_t));
+    size_t total = 0;
+    if (!sample_sizes) {
+        fprintf(stderr, "lz4huf: memory exhausted\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < n_files; i++) {
+        FILE * input = fopen(files[i], "rb");
+        if (!input) {
+            fprintf(stderr, "lz4huf: cannot open file %s for reading\n", files[i]);
+            exit(1);
+        }
+
+        size_t size = 0;
+        while (1) {
+            uint8_t * new_samples = realloc(samples, total + size + CLI_STREAM_BUF);
+            if (!new_samples) {
+                fprintf(stderr, "lz4huf: memory exhausted\n");
+                exit(1);
+            }
+
+            samples = new_samples;
+            size_t n_read = fread(samples + total + size, 1, CLI_STREAM_BUF, input);
+            size += n_read;
+            if (n_read < CLI_STREAM_BUF) break;
+        }
+
+        if (ferror(input)) {
+            fprintf(stderr, "lz4huf: read error: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        if (size > UINT32_MAX) {
+            fprintf(stderr, "lz4huf: %s: sample too large\n", files[i]);
+            exit(1);
+        }
+
+        fclose(input);
+        sample_sizes[i] = size;
+        total += size;
+    }
+
+    struct lz4huf_buffer dict = lz4huf_train_dictionary(samples, sample_sizes, n_files, capacity);
+    if (dict.error) {
+        fprintf(stderr, "lz4huf: dictionary training failed\n");
+        exit(1);
+    }
+
+    write_all(dict.data, dict.size, stdout);
+
+    if (verbose) {
+        struct lz4huf_dict * d = lz4huf_dict_create(dict.data, dict.size);
+        fprintf(stderr, "%d samples\t%" PRIu64 " bytes -> dictionary of %d bytes, ID %" PRIu32 "\n", n_files,
+                (uint64_t)total, dict.size, d ? lz4huf_dict_id(d) : 0);
+        lz4huf_dict_free(d);
+    }
+
+    free(dict.data);
+    free(samples);
+    free(sample_sizes);
+}
+
 static void close_out_file(FILE * des) {
     if (des) {
         int outfd = fileno(des);
@@ -229,13 +887,18 @@ static void close_out_file(FILE * des) {
 }
 
 int main(int argc, char * argv[]) {
-    const char * short_options = "defhpvVz0123456789";
+    const char * short_options = "CdefhlptvVz0123456789";
     static struct option long_options[] = { { "encode", no_argument, 0, 'e' },   { "decode", no_argument, 0, 'd' },
                                             { "force", no_argument, 0, 'f' },    { "help", no_argument, 0, 'h' },
                                             { "version", no_argument, 0, 'V' },  { "verbose", no_argument, 0, 'v' },
-                                            { "parallel", no_argument, 0, 'p' }, { 0, 0, 0, 0 } };
+                                            { "parallel", no_argument, 0, 'p' }, { "linked", no_argument, 0, 'l' },
+                                            { "checksum", no_argument, 0, 'C' }, { "test", no_argument, 0, 't' },
+                                            { "train", no_argument, 0, 'T' },
+                                            { "maxdict", required_argument, 0, 'M' },
+                                            { 0, 0, 0, 0 } };
     int mode = MODE_COMPRESS;
-    int force = 0, verbose = 0, jobs = 1, level = 9;
+    int force = 0, verbose = 0, jobs = 1, level = 9, flags = 0;
+    uint32_t maxdict = 65536;
     while (1) {
         int option_index = 0;
         int c = getopt_long(argc, argv, short_options, long_options, &option_index);
@@ -248,6 +911,9 @@ int main(int argc, char * argv[]) {
             case 'd':
                 mode = MODE_EXPAND;
                 break;
+            case 't':
+                mode = MODE_TEST;
+                break;
             case 'f':
                 force = 1;
                 break;
@@ -263,6 +929,23 @@ int main(int argc, char * argv[]) {
             case 'p':
                 jobs = omp_get_max_threads();
                 break;
+            case 'l':
+                flags |= LZ4HUF_FLAG_LINKED;
+                break;
+            case 'C':
+                flags |= LZ4HUF_FLAG_CHECKSUM;
+                break;
+            case 'T':
+                mode = MODE_TRAIN;
+                break;
+            case 'M':
+                if (!is_numeric(optarg) || *optarg == '\0') {
+                    fprintf(stderr, "lz4huf: illegal number: %s\n", optarg);
+                    return 1;
+                }
+
+                maxdict = strtoul(optarg, NULL, 10);
+                break;
             case '0':
             case '1':
             case '2':
@@ -311,9 +994,40 @@ int main(int argc, char * argv[]) {
     setmode(STDOUT_FILENO, O_BINARY);
 #endif
 
+    if (mode == MODE_TRAIN) {
+        if (optind == argc) {
+            fprintf(stderr, "lz4huf: no samples to train on\n");
+            return 1;
+        }
+
+        train(argv + optind, argc - optind, maxdict, verbose);
+        close_out_file(stdout);
+        return 0;
+    }
+
+    if (mode == MODE_TEST) {
+        // nothing is written, so any file can be tested
+        if (optind == argc) {
+            process(mode, "stdin", stdin, NULL, force, verbose, jobs, level, flags);
+        }
+
+        for (int i = optind; i < argc; i++) {
+            FILE * input = fopen(argv[i], "rb");
+            if (!input) {
+                fprintf(stderr, "lz4huf: cannot open file %s for reading", argv[i]);
+                return 1;
+            }
+
+            process(mode, argv[i], input, NULL, force, verbose, jobs, level, flags);
+            fclose(input);
+        }
+
+        return 0;
+    }
+
     if (optind == argc) {
         // no files specified, use stdin/stdout
-        process(mode, "stdin", stdin, stdout, force, verbose, jobs, level);
+        process(mode, "stdin", stdin, stdout, force, verbose, jobs, level, flags);
         close_out_file(stdout);
     } else {
         // process files
@@ -363,7 +1077,7 @@ int main(int argc, char * argv[]) {
                 return 1;
             }
 
-            process(mode, filename, input, output, force, verbose, jobs, level);
+            process(mode, filename, input, output, force, verbose, jobs, level, flags);
 
             close_out_file(output);
             fclose(input);